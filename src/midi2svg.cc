@@ -1,7 +1,30 @@
 #include "MidiFile.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <zlib.h>
 
 #include <cairomm/cairomm.h>
 #include <cairomm/context.h>
@@ -49,6 +72,8 @@ public:
   int pitch;
   double duration;
   double time;
+  uint16_t track;
+  uint8_t channel;
   void debug();
 };
 
@@ -58,34 +83,1801 @@ void note_t::debug()
             << std::endl;
 }
 
-class midi2svg_t {
+/**
+   Conversion of MIDI ticks into seconds, based on a compact table of
+   tempo changes.
+ */
+class tempo_map_t {
+public:
+  tempo_map_t(double secpertick);
+  void add(uint64_t tick, double secpertick);
+  double seconds(uint64_t tick) const;
+
+private:
+  struct segment_t {
+    uint64_t tick;
+    double seconds;
+    double secpertick;
+  };
+  std::vector<segment_t> segments;
+};
+
+tempo_map_t::tempo_map_t(double secpertick) : segments({{0, 0.0, secpertick}})
+{
+}
+
+/**
+   Add a tempo change. Tempo changes need to be added in time order.
+ */
+void tempo_map_t::add(uint64_t tick, double secpertick)
+{
+  segment_t& last(segments.back());
+  if(tick < last.tick)
+    throw std::runtime_error("tempo changes are not in time order");
+  if(tick == last.tick)
+    last.secpertick = secpertick;
+  else
+    segments.push_back(
+        {tick, last.seconds + (tick - last.tick) * last.secpertick,
+         secpertick});
+}
+
+double tempo_map_t::seconds(uint64_t tick) const
+{
+  auto seg(std::upper_bound(
+      segments.begin(), segments.end(), tick,
+      [](uint64_t t, const segment_t& segment) { return t < segment.tick; }));
+  --seg;
+  return seg->seconds + (tick - seg->tick) * seg->secpertick;
+}
+
+/**
+   Pairing of note-ons and note-offs within one track. Open notes are
+   kept on a stack per channel and pitch, so a note-off ends the most
+   recent note-on of the same key. The stacks are linked lists in a
+   single array, which reuses the slots of ended notes. Open notes can
+   be placed before their note-off, once their hole does not depend on
+   it any more.
+ */
+class note_pairing_t {
+public:
+  note_pairing_t(uint16_t track, std::pmr::memory_resource* mr);
+  void note_on(uint8_t channel, uint8_t pitch, double time);
+  bool note_off(uint8_t channel, uint8_t pitch, double time, note_t& note,
+                bool* placed = nullptr);
+  template <class F> double earliest_open(F counts) const;
+  template <class F> void place(double before, double now, F emit);
+  template <class F> void flush(F emit);
+
+private:
+  struct open_note_t {
+    double time;
+    int32_t next;
+    uint16_t key;
+    bool placed;
+  };
+  note_t open_note(const open_note_t& onote, double now) const
+  {
+    return note_t({onote.key & 0x7f, now - onote.time, onote.time, track,
+                   (uint8_t)(onote.key >> 7)});
+  }
+  uint16_t track;
+  int32_t top[16 * 128];
+  int32_t unused;
+  std::pmr::vector<open_note_t> open;
+};
+
+note_pairing_t::note_pairing_t(uint16_t track, std::pmr::memory_resource* mr)
+    : track(track), unused(-1), open(mr)
+{
+  std::fill(std::begin(top), std::end(top), -1);
+}
+
+void note_pairing_t::note_on(uint8_t channel, uint8_t pitch, double time)
+{
+  uint16_t key((channel << 7) | pitch);
+  int32_t& head(top[key]);
+  int32_t slot(unused);
+  if(slot < 0) {
+    slot = open.size();
+    open.push_back({time, head, key, false});
+  } else {
+    unused = open[slot].next;
+    open[slot] = {time, head, key, false};
+  }
+  head = slot;
+}
+
+/**
+   End the most recent open note of a key. Returns false if no note of
+   that key is open. If given, placed tells whether the note was
+   already placed.
+ */
+bool note_pairing_t::note_off(uint8_t channel, uint8_t pitch, double time,
+                              note_t& note, bool* placed)
+{
+  int32_t& head(top[(channel << 7) | pitch]);
+  if(head < 0)
+    return false;
+  int32_t slot(head);
+  note = open_note(open[slot], time);
+  if(placed)
+    *placed = open[slot].placed;
+  head = open[slot].next;
+  open[slot] = {std::numeric_limits<double>::quiet_NaN(), unused, 0, false};
+  unused = slot;
+  return true;
+}
+
+// Start time of the earliest open note which is not placed and which
+// counts, or infinity if there is none:
+template <class F> double note_pairing_t::earliest_open(F counts) const
+{
+  double earliest(std::numeric_limits<double>::infinity());
+  for(const auto& onote : open)
+    if(!onote.placed && (onote.time < earliest) &&
+       counts(open_note(onote, onote.time)))
+      earliest = onote.time;
+  return earliest;
+}
+
+/**
+   Pass the open notes which started no later than a given time to
+   emit, with their duration until now. Notes which emit accepts are
+   placed; they stay open until their note-off.
+ */
+template <class F>
+void note_pairing_t::place(double before, double now, F emit)
+{
+  for(auto& onote : open)
+    if(!onote.placed && (onote.time <= before) && emit(open_note(onote, now)))
+      onote.placed = true;
+}
+
+/**
+   Emit all remaining open notes, and whether they were placed. Notes
+   without note-off have no duration.
+ */
+template <class F> void note_pairing_t::flush(F emit)
+{
+  for(int32_t key = 0; key < 16 * 128; ++key)
+    for(int32_t slot = top[key]; slot >= 0; slot = open[slot].next)
+      emit(open_note(open[slot], open[slot].time), open[slot].placed);
+  std::fill(std::begin(top), std::end(top), -1);
+  unused = -1;
+  open.clear();
+}
+
+// MIDI event as delivered by midi_stream_t. Only channel messages and
+// tempo changes are reported.
+struct midi_event_t {
+  uint64_t tick;
+  double seconds;
+  uint32_t track;
+  uint8_t status; // 0xff for tempo changes
+  uint8_t data1;
+  uint8_t data2;
+  uint32_t tempo; // microseconds per quarter note
+};
+
+/**
+   Sequential decoder of a single track chunk, reading through a small
+   buffer.
+ */
+class track_reader_t {
+public:
+  track_reader_t(std::ifstream& file, uint64_t start, uint64_t end);
+  bool next(midi_event_t& event);
+
+private:
+  uint8_t byte();
+  uint32_t vlq();
+  void skip(uint32_t len);
+  std::ifstream& file;
+  uint64_t filepos;
+  uint64_t end;
+  std::vector<char> buf;
+  size_t bufpos;
+  size_t buflen;
+  uint64_t tick;
+  uint8_t runningstatus;
+};
+
+track_reader_t::track_reader_t(std::ifstream& file_, uint64_t start,
+                               uint64_t end_)
+    : file(file_), filepos(start), end(end_), buf(4096), bufpos(0), buflen(0),
+      tick(0), runningstatus(0)
+{
+}
+
+uint8_t track_reader_t::byte()
+{
+  if(bufpos == buflen) {
+    if(filepos >= end)
+      throw std::runtime_error("truncated MIDI track");
+    buflen = std::min((uint64_t)buf.size(), end - filepos);
+    file.clear();
+    file.seekg(filepos);
+    file.read(buf.data(), buflen);
+    if((size_t)file.gcount() != buflen)
+      throw std::runtime_error("truncated MIDI file");
+    filepos += buflen;
+    bufpos = 0;
+  }
+  return buf[bufpos++];
+}
+
+uint32_t track_reader_t::vlq()
+{
+  uint32_t v(0);
+  uint8_t c(0);
+  do {
+    c = byte();
+    v = (v << 7) | (c & 0x7f);
+  } while(c & 0x80);
+  return v;
+}
+
+void track_reader_t::skip(uint32_t len)
+{
+  size_t inbuf(std::min((size_t)len, buflen - bufpos));
+  bufpos += inbuf;
+  len -= inbuf;
+  if(len) {
+    if(len > end - filepos)
+      throw std::runtime_error("truncated MIDI track");
+    filepos += len;
+  }
+}
+
+/**
+   Decode the next channel message or tempo change, return false at
+   the end of the track. The tick is absolute, seconds are not set.
+ */
+bool track_reader_t::next(midi_event_t& event)
+{
+  while((bufpos < buflen) || (filepos < end)) {
+    tick += vlq();
+    uint8_t status(byte());
+    if(status == 0xff) {
+      uint8_t type(byte());
+      uint32_t len(vlq());
+      if(type == 0x2f)
+        return false;
+      if((type == 0x51) && (len == 3)) {
+        event.tick = tick;
+        event.status = status;
+        event.data1 = type;
+        event.data2 = 0;
+        event.tempo = byte() << 16;
+        event.tempo |= byte() << 8;
+        event.tempo |= byte();
+        return true;
+      }
+      skip(len);
+    } else if((status == 0xf0) || (status == 0xf7)) {
+      skip(vlq());
+    } else {
+      uint8_t data1(0);
+      if(status & 0x80) {
+        runningstatus = status;
+        data1 = byte();
+      } else {
+        if(!runningstatus)
+          throw std::runtime_error("invalid MIDI running status");
+        data1 = status;
+        status = runningstatus;
+      }
+      uint8_t data2(0);
+      if(((status & 0xf0) != 0xc0) && ((status & 0xf0) != 0xd0))
+        data2 = byte();
+      event.tick = tick;
+      event.status = status;
+      event.data1 = data1;
+      event.data2 = data2;
+      event.tempo = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+   Incremental reader for standard MIDI files. Each track is decoded
+   through its own small buffer and the events of all tracks are merged
+   by tick, so memory use does not depend on the length of the file.
+ */
+class midi_stream_t {
+public:
+  midi_stream_t(const std::string& fname);
+  bool next(midi_event_t& event);
+  bool has_notes(uint32_t track) const { return hasnotes[track]; };
+  size_t size() const { return tracks.size(); };
+
+private:
+  std::ifstream file;
+  uint32_t division;
+  std::vector<track_reader_t> tracks;
+  std::vector<midi_event_t> pending;
+  std::vector<bool> valid;
+  std::vector<bool> hasnotes;
+  tempo_map_t tempo;
+};
+
+midi_stream_t::midi_stream_t(const std::string& fname)
+    : file(fname, std::ios::binary), division(0), tempo(0)
+{
+  uint8_t hdr[14];
+  if(!file.read((char*)hdr, sizeof(hdr)) || memcmp(hdr, "MThd", 4))
+    throw std::runtime_error("unable to read MIDI file " + fname);
+  uint64_t pos(8 + (((uint32_t)hdr[4] << 24) | (hdr[5] << 16) |
+                    (hdr[6] << 8) | hdr[7]));
+  uint32_t ntracks((hdr[10] << 8) | hdr[11]);
+  division = (hdr[12] << 8) | hdr[13];
+  if(division & 0x8000)
+    // SMPTE time code: frames per second times ticks per frame
+    tempo = tempo_map_t(1.0 / (-(int8_t)(division >> 8) * (division & 0xff)));
+  else
+    tempo = tempo_map_t(0.5 / division);
+  while(tracks.size() < ntracks) {
+    uint8_t chunk[8];
+    file.clear();
+    file.seekg(pos);
+    if(!file.read((char*)chunk, sizeof(chunk)))
+      break;
+    uint64_t len(((uint32_t)chunk[4] << 24) | (chunk[5] << 16) |
+                 (chunk[6] << 8) | chunk[7]);
+    if(memcmp(chunk, "MTrk", 4) == 0)
+      tracks.emplace_back(file, pos + 8, pos + 8 + len);
+    pos += 8 + len;
+  }
+  // pre-scan tracks, only tracks with notes outside the percussion
+  // channel are converted:
+  for(auto trk : tracks) {
+    // scan on a copy of the reader, which keeps the original at the
+    // start of the track:
+    midi_event_t event;
+    bool notes(false);
+    while(!notes && trk.next(event))
+      notes = ((event.status & 0xf0) == 0x90) && event.data2 &&
+              ((event.status & 0x0f) != 0x09);
+    hasnotes.push_back(notes);
+  }
+  pending.resize(tracks.size());
+  for(uint32_t k = 0; k < tracks.size(); ++k) {
+    valid.push_back(tracks[k].next(pending[k]));
+    pending[k].track = k;
+  }
+}
+
+/**
+   Return the next event of all tracks in time order, false at the end
+   of the file.
+ */
+bool midi_stream_t::next(midi_event_t& event)
+{
+  uint32_t trk(tracks.size());
+  for(uint32_t k = 0; k < tracks.size(); ++k)
+    if(valid[k] && ((trk == tracks.size()) ||
+                    (pending[k].tick < pending[trk].tick)))
+      trk = k;
+  if(trk == tracks.size())
+    return false;
+  event = pending[trk];
+  if((event.status == 0xff) && !(division & 0x8000))
+    tempo.add(event.tick, 1e-6 * event.tempo / division);
+  event.seconds = tempo.seconds(event.tick);
+  valid[trk] = tracks[trk].next(pending[trk]);
+  pending[trk].track = trk;
+  return true;
+}
+
+bool hasNotes(const smf::MidiEventList& eventlist)
+{
+  for(int i = 0; i < eventlist.size(); i++) {
+    if(eventlist[i].isNoteOn()) {
+      if(eventlist[i].getChannel() != 0x09) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+   Decode the notes of a MIDI file into an instrument independent note
+   list, with times in seconds from the start of the file. Tracks
+   without notes are skipped.
+ */
+void decode_midi(const std::string& midi_file,
+                 std::pmr::vector<note_t>& notes)
+{
+  smf::MidiFile midifile;
+  if(!midifile.read(midi_file))
+    throw std::runtime_error("unable to read MIDI file " + midi_file);
+  // ticks to seconds mapping from the tempo changes of all tracks, only
+  // used for the retained notes:
+  int tpq(midifile.getTicksPerQuarterNote());
+  std::vector<std::pair<int, int>> tempochanges;
+  for(int k = 0; k < midifile.size(); ++k) {
+    smf::MidiEventList& eventlist(midifile[k]);
+    for(int kevent = 0; kevent < eventlist.size(); ++kevent)
+      if(eventlist[kevent].isTempo())
+        tempochanges.push_back({eventlist[kevent].tick,
+                                eventlist[kevent].getTempoMicroseconds()});
+  }
+  std::stable_sort(
+      tempochanges.begin(), tempochanges.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  tempo_map_t tempo(0.5 / tpq);
+  for(const auto& change : tempochanges)
+    tempo.add(change.first, 1e-6 * change.second / tpq);
+  // pair note-ons and note-offs of the tracks with notes only:
+  for(int k = 0; k < midifile.size(); ++k) {
+    smf::MidiEventList& eventlist(midifile[k]);
+    if(!hasNotes(eventlist))
+      continue;
+    note_pairing_t pairing(k, std::pmr::get_default_resource());
+    auto end_note = [&](const note_t& note) { notes.push_back(note); };
+    for(int kevent = 0; kevent < eventlist.size(); ++kevent) {
+      auto& event(eventlist[kevent]);
+      note_t note;
+      if(event.isNoteOn())
+        pairing.note_on(event.getChannel(), event.getP1(),
+                        tempo.seconds(event.tick));
+      else if(event.isNoteOff() &&
+              pairing.note_off(event.getChannel(), event.getP1(),
+                               tempo.seconds(event.tick), note))
+        end_note(note);
+    }
+    pairing.flush([&](const note_t& note, bool) { end_note(note); });
+  }
+}
+
+// Note data as separate contiguous arrays, for vectorized processing:
+class note_arrays_t {
+public:
+  note_arrays_t(std::pmr::memory_resource* mr);
+  void clear();
+  void push_back(const note_t& note, double lanepos);
+  size_t size() const { return time.size(); };
+  std::pmr::vector<double> time;     // seconds
+  std::pmr::vector<double> duration; // seconds
+  std::pmr::vector<double> lane;     // lane position in mm
+};
+
+note_arrays_t::note_arrays_t(std::pmr::memory_resource* mr)
+    : time(mr), duration(mr), lane(mr)
+{
+}
+
+void note_arrays_t::clear()
+{
+  time.clear();
+  duration.clear();
+  lane.clear();
+}
+
+void note_arrays_t::push_back(const note_t& note, double lanepos)
+{
+  time.push_back(note.time);
+  duration.push_back(note.duration);
+  lane.push_back(lanepos);
+}
+
+// Absolute layout of the tape: note rectangles in mm, sorted by their
+// start, all of height notewidth.
+class layout_t {
+public:
+  layout_t(std::pmr::memory_resource* mr);
+  void resize(size_t n);
+  void sort();
+  size_t merge_overlaps();
+  size_t size() const { return x.size(); };
+  std::pmr::vector<double> x;  // start
+  std::pmr::vector<double> x2; // end
+  std::pmr::vector<double> y;  // upper edge on the page
+  double maxlength;            // length of the longest rectangle
+};
+
+layout_t::layout_t(std::pmr::memory_resource* mr)
+    : x(mr), x2(mr), y(mr), maxlength(0)
+{
+}
+
+void layout_t::resize(size_t n)
+{
+  x.resize(n);
+  x2.resize(n);
+  y.resize(n);
+}
+
+void layout_t::sort()
+{
+  std::pmr::vector<size_t> idx(x.size(), x.get_allocator());
+  for(size_t k = 0; k < idx.size(); ++k)
+    idx[k] = k;
+  std::stable_sort(idx.begin(), idx.end(),
+                   [&](size_t a, size_t b) { return x[a] < x[b]; });
+  std::pmr::vector<double> tmp(x.size(), x.get_allocator());
+  for(auto vec : {&x, &x2, &y}) {
+    for(size_t k = 0; k < idx.size(); ++k)
+      tmp[k] = (*vec)[idx[k]];
+    vec->swap(tmp);
+  }
+  maxlength = 0;
+  for(size_t k = 0; k < x.size(); ++k)
+    maxlength = std::max(maxlength, x2[k] - x[k]);
+}
+
+/**
+   Merge overlapping or touching rectangles of the same lane, e.g. of a
+   voice doubled in several tracks, so that no hole is cut twice. A
+   sweep in start order keeps the last rectangle of each lane. The
+   rectangles must be sorted. Returns the number of removed rectangles.
+ */
+size_t layout_t::merge_overlaps()
+{
+  std::pmr::map<double, size_t> last(x.get_allocator().resource());
+  size_t n(0);
+  for(size_t k = 0; k < x.size(); ++k) {
+    auto lane(last.find(y[k]));
+    if((lane != last.end()) && (x[k] <= x2[lane->second])) {
+      x2[lane->second] = std::max(x2[lane->second], x2[k]);
+      continue;
+    }
+    x[n] = x[k];
+    x2[n] = x2[k];
+    y[n] = y[k];
+    last[y[k]] = n;
+    ++n;
+  }
+  size_t removed(x.size() - n);
+  resize(n);
+  maxlength = 0;
+  for(size_t k = 0; k < n; ++k)
+    maxlength = std::max(maxlength, x2[k] - x[k]);
+  return removed;
+}
+
+// Compact buffer of page rectangles in mm, all of height notewidth:
+class rect_buffer_t {
+public:
+  rect_buffer_t(std::pmr::memory_resource* mr);
+  void resize(size_t n);
+  size_t size;
+  std::pmr::vector<double> x;
+  std::pmr::vector<double> y;
+  std::pmr::vector<double> w;
+};
+
+rect_buffer_t::rect_buffer_t(std::pmr::memory_resource* mr)
+    : size(0), x(mr), y(mr), w(mr)
+{
+}
+
+void rect_buffer_t::resize(size_t n)
+{
+  size = n;
+  if(x.size() < n) {
+    x.resize(n);
+    y.resize(n);
+    w.resize(n);
+  }
+}
+
+// Geometry parameters of the layout kernel:
+struct layout_param_t {
+  double speed;
+  double mingaplength;
+  double minnotelength;
+  double maxnotelength;
+  double ytop; // paperwidth - 0.5 * notewidth
+};
+
+/**
+   Compute the absolute rectangles of n notes: convert to mm, remove
+   the gap and limit the length. The loop is branch free and works on
+   plain arrays, so that the compiler can vectorize it.
+ */
+void layout_kernel(size_t n, const double* __restrict time,
+                   const double* __restrict duration,
+                   const double* __restrict lane, layout_param_t p,
+                   double* __restrict x, double* __restrict x2,
+                   double* __restrict y)
+{
+  for(size_t k = 0; k < n; ++k) {
+    double x1(time[k] * p.speed);
+    double len(duration[k] * p.speed);
+    len -= (len >= p.mingaplength) ? p.mingaplength : 0.0;
+    len = std::max(std::min(len, p.maxnotelength), p.minnotelength);
+    x[k] = x1;
+    x2[k] = x1 + len;
+    y[k] = p.ytop - lane[k];
+  }
+}
+
+/**
+   Translate n absolute rectangles to a page and clip them to it.
+   Rectangles outside of the page get zero width.
+ */
+void page_rects_kernel(size_t n, const double* __restrict x,
+                       const double* __restrict x2,
+                       const double* __restrict y, double offset_mm,
+                       double pagelength, double* __restrict px,
+                       double* __restrict py, double* __restrict pw)
+{
+  for(size_t k = 0; k < n; ++k) {
+    double x1(std::max(0.0, std::min(pagelength, x[k] - offset_mm)));
+    double x2p(std::max(0.0, std::min(pagelength, x2[k] - offset_mm)));
+    px[k] = x1;
+    py[k] = y[k];
+    pw[k] = x2p - x1;
+  }
+}
+
+/**
+   Remove rectangles with zero width, without branches.
+ */
+void compact_rects(rect_buffer_t& rects)
+{
+  size_t n(0);
+  for(size_t k = 0; k < rects.size; ++k) {
+    rects.x[n] = rects.x[k];
+    rects.y[n] = rects.y[k];
+    rects.w[n] = rects.w[k];
+    n += (rects.w[k] > 0);
+  }
+  rects.size = n;
+}
+
+// 64 bit FNV-1a hash, used to detect stale compiled profiles:
+uint64_t fnv1a(const std::string& data)
+{
+  uint64_t h(0xcbf29ce484222325ull);
+  for(auto c : data) {
+    h ^= (uint8_t)c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+// On-disk layout of a compiled instrument profile. Lane positions are
+// stored densely for all MIDI pitches, NaN marks pitches without a lane.
+struct profile_t {
+  char magic[4];
+  uint32_t version;
+  uint64_t srchash; // hash of the JSON source
+  double paperwidth;
+  double maxpaperlength;
+  double notewidth;
+  double speed;
+  double minnotelength;
+  double maxnotelength;
+  double mingaplength;
+  double offset;
+  double presilence;
+  double postsilence;
+  uint8_t cuthighedge;
+  uint8_t cutlowedge;
+  uint8_t cutend;
+  uint8_t reserved;
+  uint32_t routeslength; // length of the routing rules after the profile
+  double lanes[128];
+};
+
+#define PROFILE_MAGIC "M2SP"
+#define PROFILE_VERSION 2
+#define PROFILE_EXT ".m2sp"
+
+/**
+   Routing rule which assigns the notes of some MIDI tracks and
+   channels to a separate output tape. Empty lists match all tracks or
+   channels.
+ */
+struct tape_route_t {
+  bool matches(const note_t& note) const;
+  nlohmann::json to_json() const;
+  std::string name;              // appended to the output names
+  std::vector<uint16_t> tracks;  // track index in the file, from 0
+  std::vector<uint8_t> channels; // MIDI channel, from 0
+};
+
+bool tape_route_t::matches(const note_t& note) const
+{
+  return (tracks.empty() || (std::find(tracks.begin(), tracks.end(),
+                                       note.track) != tracks.end())) &&
+         (channels.empty() || (std::find(channels.begin(), channels.end(),
+                                         note.channel) != channels.end()));
+}
+
+// Configuration representation, with channels counted from 1:
+nlohmann::json tape_route_t::to_json() const
+{
+  nlohmann::json js({{"name", name}, {"tracks", tracks}});
+  std::vector<int> chan;
+  for(auto channel : channels)
+    chan.push_back(channel + 1);
+  js["channels"] = chan;
+  return js;
+}
+
+class instrument_t {
+public:
+  instrument_t();
+  instrument_t(const instrument_t& src, std::pmr::memory_resource* mr);
+  instrument_t(const instrument_t&) = default;
+  instrument_t& operator=(const instrument_t&) = default;
+  void load(const std::string& cfgfile);
+  void read_json(const std::string& config);
+  bool read_profile(const std::string& data, uint64_t srchash);
+  void compile(const std::string& cfgfile);
+  profile_t profile() const;
+  uint64_t hash() const;
+  void load_preset(const std::string& name);
+  void list_pitches() const;
+  void read_routes(const nlohmann::json& js_routes);
+  std::vector<std::string> tape_tags(bool named) const;
+  std::pmr::map<int, double> pitches;
+  double paperwidth;     // mm
+  double maxpaperlength; // mm
+  double notewidth;      // mm
+  double speed;          // mm/s
+  double minnotelength;  // mm
+  double maxnotelength;  // mm
+  double mingaplength;   // mm
+  bool cuthighedge;
+  bool cutlowedge;
+  bool cutend;
+  double offset;      // mm
+  double presilence;  // seconds
+  double postsilence; // seconds
+  std::string name;   // tags the output when using several instruments
+  // separate tapes, or empty for a single tape with all notes:
+  std::vector<tape_route_t> routes;
+};
+
+/**
+   Compress data into the gzip format.
+ */
+std::string gzip(const std::string& data)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // window bits + 16 selects the gzip header:
+  if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                  Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("unable to initialize compression");
+  std::string retv(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = (Bytef*)data.data();
+  zs.avail_in = data.size();
+  zs.next_out = (Bytef*)retv.data();
+  zs.avail_out = retv.size();
+  int err(deflate(&zs, Z_FINISH));
+  retv.resize(zs.total_out);
+  deflateEnd(&zs);
+  if(err != Z_STREAM_END)
+    throw std::runtime_error("compression failed");
+  return retv;
+}
+
+/**
+   Asynchronous file writer. Completed output files are passed as
+   memory buffers and written by a dedicated I/O thread, which takes
+   all queued files at once. Rendering of the next pages thus overlaps
+   with writing the previous ones, and so does compression, which is
+   done by the I/O thread as well. The queue is bounded in bytes, and
+   writing blocks while it is full.
+
+   Files can be appended to tar archives instead, which are completed
+   by close_archive().
+ */
+class output_writer_t {
+public:
+  output_writer_t(size_t maxqueued = 64 << 20);
+  ~output_writer_t();
+  void write(std::string name, std::string data, bool compress = false);
+  void write_to_archive(std::string archive, std::string name,
+                        std::string data, bool compress = false);
+  void close_archive(std::string archive);
+  std::vector<std::string> close();
+
+private:
+  struct file_t {
+    std::string archive; // tar archive, or empty
+    std::string name;    // file name, or empty to close the archive
+    std::string data;
+    bool compress;
+  };
+  void enqueue(file_t file);
+  void store(file_t& file);
+  void run();
+  std::mutex mtx;
+  // signalled when files are queued or written, and on close:
+  std::condition_variable cond;
+  std::vector<file_t> queue;
+  size_t queued; // bytes queued or being written
+  size_t maxqueued;
+  bool closing;
+  std::vector<std::string> failed;
+  // archives which are open, only used by the I/O thread:
+  std::map<std::string, std::ofstream> archives;
+  std::vector<std::string> batchfailed;
+  std::thread thread;
+};
+
+output_writer_t::output_writer_t(size_t maxqueued)
+    : queued(0), maxqueued(maxqueued), closing(false)
+{
+  thread = std::thread(&output_writer_t::run, this);
+}
+
+output_writer_t::~output_writer_t()
+{
+  close();
+}
+
+void output_writer_t::write(std::string name, std::string data, bool compress)
+{
+  enqueue({"", std::move(name), std::move(data), compress});
+}
+
+void output_writer_t::write_to_archive(std::string archive, std::string name,
+                                       std::string data, bool compress)
+{
+  enqueue({std::move(archive), std::move(name), std::move(data), compress});
+}
+
+void output_writer_t::close_archive(std::string archive)
+{
+  enqueue({std::move(archive), "", "", false});
+}
+
+void output_writer_t::enqueue(file_t file)
+{
+  std::unique_lock<std::mutex> lock(mtx);
+  // a single file larger than the limit is accepted into an empty
+  // queue:
+  cond.wait(lock, [&]() {
+    return (queued == 0) || (queued + file.data.size() <= maxqueued);
+  });
+  queued += file.data.size();
+  queue.push_back(std::move(file));
+  cond.notify_all();
+}
+
+/**
+   Wait until all queued files are written and stop the I/O thread.
+   Returns the names of the files which could not be written.
+ */
+std::vector<std::string> output_writer_t::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    closing = true;
+    cond.notify_all();
+  }
+  if(thread.joinable())
+    thread.join();
+  return failed;
+}
+
+/**
+   Add an entry to a tar archive: a ustar header of the given type,
+   followed by the data padded to full blocks. Names are cut at the 100
+   bytes of the header.
+ */
+void tar_entry(std::ostream& os, const std::string& name,
+               const std::string& data, char type)
+{
+  char block[512];
+  memset(block, 0, sizeof(block));
+  memcpy(block, name.data(), std::min(name.size(), (size_t)100));
+  snprintf(block + 100, 8, "%07o", 0644);
+  snprintf(block + 108, 8, "%07o", 0);
+  snprintf(block + 116, 8, "%07o", 0);
+  snprintf(block + 124, 12, "%011llo", (unsigned long long)data.size());
+  snprintf(block + 136, 12, "%011llo", (unsigned long long)time(nullptr));
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  memset(block + 148, ' ', 8);
+  uint32_t checksum(0);
+  for(size_t k = 0; k < sizeof(block); ++k)
+    checksum += (uint8_t)block[k];
+  snprintf(block + 148, 8, "%06o", checksum);
+  os.write(block, sizeof(block));
+  os.write(data.data(), data.size());
+  memset(block, 0, sizeof(block));
+  os.write(block,
+           (sizeof(block) - data.size() % sizeof(block)) % sizeof(block));
+}
+
+// write a file, or add it to its archive, in the I/O thread:
+void output_writer_t::store(file_t& file)
+{
+  if(file.compress)
+    file.data = gzip(file.data);
+  if(file.archive.empty()) {
+    std::ofstream ofs(file.name, std::ios::binary);
+    if(!ofs.write(file.data.data(), file.data.size()) || !ofs.flush())
+      batchfailed.push_back(file.name);
+    return;
+  }
+  auto arch(archives.find(file.archive));
+  char block[512];
+  memset(block, 0, sizeof(block));
+  if(file.name.empty()) {
+    // archives without entries are not created:
+    if(arch == archives.end())
+      return;
+    std::ofstream& ofs(arch->second);
+    // end of archive marker:
+    ofs.write(block, sizeof(block));
+    ofs.write(block, sizeof(block));
+    if(!ofs.flush())
+      batchfailed.push_back(file.archive);
+    archives.erase(arch);
+    return;
+  }
+  if(arch == archives.end())
+    arch = archives
+               .emplace(file.archive,
+                        std::ofstream(file.archive, std::ios::binary))
+               .first;
+  std::ofstream& ofs(arch->second);
+  // longer names are stored in a pax extended header, entry names have
+  // no directory which could go into the ustar prefix:
+  if(file.name.size() > 100) {
+    std::string record(" path=" + file.name + "\n");
+    // the record length includes its own digits:
+    size_t len(record.size() + 1);
+    while(len != std::to_string(len).size() + record.size())
+      len = std::to_string(len).size() + record.size();
+    tar_entry(ofs, "././@PaxHeader", std::to_string(len) + record, 'x');
+  }
+  tar_entry(ofs, file.name, file.data, '0');
+  if(!ofs)
+    batchfailed.push_back(file.archive + ": " + file.name);
+}
+
+void output_writer_t::run()
+{
+  std::vector<file_t> batch;
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, [&]() { return closing || !queue.empty(); });
+      if(queue.empty())
+        return;
+      batch.swap(queue);
+    }
+    size_t written(0);
+    for(auto& file : batch) {
+      written += file.data.size();
+      try {
+        store(file);
+      }
+      catch(const std::exception&) {
+        batchfailed.push_back(file.name);
+      }
+    }
+    batch.clear();
+    std::lock_guard<std::mutex> lock(mtx);
+    failed.insert(failed.end(), batchfailed.begin(), batchfailed.end());
+    batchfailed.clear();
+    queued -= written;
+    cond.notify_all();
+  }
+}
+
+/**
+   Operation layers of the output, in the order in which they are
+   written: engraving first, then the holes, and the edges last, so
+   the strip is cut free at the end.
+ */
+enum layer_t {
+  LAYER_ENGRAVE_LABELS,
+  LAYER_MARKS,
+  LAYER_CUT_HOLES,
+  LAYER_CUT_EDGES,
+  LAYER_COUNT
+};
+
+constexpr const char* layer_names[LAYER_COUNT] = {"engrave-labels", "marks",
+                                                  "cut-holes", "cut-edges"};
+
+// Machine model of the cut job estimate:
+struct machine_t {
+  double cutspeed;    // mm/s, also used for engraving
+  double travelspeed; // mm/s
+  double piercetime;  // seconds per path
+};
+
+// Output settings which are not part of the instrument:
+class output_cfg_t {
+public:
+  output_cfg_t();
+  bool stream;
+  // output formats, "svg", "svgz", "png", "pdf" or "dxf":
+  std::vector<std::string> formats;
+  double dpi;         // resolution of PNG output
+  uint32_t rasterthreads;
+  std::string overview;  // overview format, "png" or "json", or empty
+  uint32_t overviewbins; // number of time bins of the overview
+  std::string cachedir;  // layout cache directory, or empty
+  uint64_t cachesize;    // size limit of the layout cache in bytes
+  output_writer_t* writer; // asynchronous file writer of the batch
+  bool archive;            // collect the pages of a file in a tar archive
+  uint32_t colours[LAYER_COUNT]; // 0xRRGGBB colour of each layer
+  bool instanced;                // SVG holes as uses of shared symbols
+  bool dedup; // merge overlapping holes of the same lane
+  bool dryrun;       // only estimate the cut job, write no files
+  machine_t machine; // machine model of the estimate
+};
+
+output_cfg_t::output_cfg_t()
+    : stream(false), formats({"svg"}), dpi(96), rasterthreads(1),
+      overviewbins(512), cachesize(256 << 20), writer(nullptr),
+      archive(false), colours{0xff0000, 0xff0000, 0x000000, 0x000000},
+      instanced(false), dedup(false), dryrun(false), machine({20, 200, 0.1})
+{
+}
+
+/**
+   Single stroke vector font for engraving the page labels, so the
+   laser traces each stroke once. Glyphs are polylines on a grid of
+   5 x 9 units, with the baseline at y = 2 and the cap height at y =
+   8. Each point is encoded by its x and y digit, strokes are separated
+   by spaces.
+ */
+struct glyph_src_t {
+  char c;
+  const char* strokes;
+};
+
+constexpr glyph_src_t glyph_sources[] = {
+    {'A', "022842 1535"},
+    {'B', "02083847463505 3544433202"},
+    {'C', "4738180703123243"},
+    {'D', "02082846442202"},
+    {'E', "48080242 0535"},
+    {'F', "480802 0535"},
+    {'G', "47381807031232434525"},
+    {'H', "0208 4248 0545"},
+    {'I', "1838 2822 1232"},
+    {'J', "4843321203"},
+    {'K', "0208 4804 1542"},
+    {'L', "080242"},
+    {'M', "0208244842"},
+    {'N', "02084248"},
+    {'O', "183847433212030718"},
+    {'P', "02083847463505"},
+    {'Q', "183847433212030718 2442"},
+    {'R', "02083847463505 2542"},
+    {'S', "473818070615354443321203"},
+    {'T', "0848 2822"},
+    {'U', "080312324348"},
+    {'V', "082248"},
+    {'W', "0812253248"},
+    {'X', "0842 0248"},
+    {'Y', "082548 2522"},
+    {'Z', "08480242"},
+    {'a', "16364542 441403123243"},
+    {'b', "0802 0516364543321203"},
+    {'c', "4536160503123243"},
+    {'d', "4842 4536160503123243"},
+    {'e', "04444536160503123243"},
+    {'f', "4738281712 0636"},
+    {'g', "4536160503123243 4641301001"},
+    {'h', "0802 0516364542"},
+    {'i', "2622 2827"},
+    {'j', "3631201001 3837"},
+    {'k', "0802 4603 1442"},
+    {'l', "182822 1232"},
+    {'m', "0602 05162522 25364542"},
+    {'n', "0602 0516364542"},
+    {'o', "163645433212030516"},
+    {'p', "0600 0516364543321203"},
+    {'q', "4640 4536160503123243"},
+    {'r', "0602 042646"},
+    {'s', "45361605143443321203"},
+    {'t', "18132232 0636"},
+    {'u', "0603123243 4642"},
+    {'v', "062246"},
+    {'w', "0612243246"},
+    {'x', "0642 0246"},
+    {'y', "0622 4610"},
+    {'z', "06460242"},
+    {'0', "183847433212030718 1436"},
+    {'1', "172822 1232"},
+    {'2', "07183847460242"},
+    {'3', "07183847463525 354443321203"},
+    {'4', "32380444"},
+    {'5', "480805354443321203"},
+    {'6', "473818070312324344351504"},
+    {'7', "084822"},
+    {'8', "15060718384746351504031232434435"},
+    {'9', "031232434738180706153546"},
+    {'.', "2223"},
+    {',', "2311"},
+    {':', "2324 2627"},
+    {'_', "0141"},
+    {'-', "1535"},
+    {'+', "1535 2426"},
+    {'=', "0444 0646"},
+    {'/', "0248"},
+    {'(', "38272332"},
+    {')', "18272312"},
+    {'?', "071838474624 2322"},
+    {' ', ""},
+};
+
+#define STROKE_GLYPH_POINTS 24
+#define STROKE_GLYPH_ADVANCE 5
+
+// decoded glyphs by ASCII code, pen up is marked by x = -1:
+struct stroke_font_t {
+  uint8_t count[128];
+  bool defined[128];
+  int8_t x[128][STROKE_GLYPH_POINTS];
+  int8_t y[128][STROKE_GLYPH_POINTS];
+};
+
+constexpr stroke_font_t make_stroke_font()
+{
+  stroke_font_t font{};
+  for(const auto& src : glyph_sources) {
+    uint8_t c(src.c);
+    uint8_t n(0);
+    for(const char* p = src.strokes; *p; ++n) {
+      if(n >= STROKE_GLYPH_POINTS)
+        throw std::logic_error("too many points in glyph");
+      if(*p == ' ') {
+        font.x[c][n] = -1;
+        ++p;
+      } else {
+        font.x[c][n] = p[0] - '0';
+        font.y[c][n] = p[1] - '0';
+        p += 2;
+      }
+    }
+    font.count[c] = n;
+    font.defined[c] = true;
+  }
+  return font;
+}
+
+constexpr stroke_font_t stroke_font(make_stroke_font());
+
+/**
+   Polylines of a text in the single stroke font, in mm relative to
+   the start of the baseline, with a cap height of 3 mm. Pen up is
+   marked by NaN. The polylines are cached per string.
+ */
+const std::vector<std::pair<double, double>>&
+stroke_text_path(const std::string& text)
+{
+  const double unit(0.5);
+  thread_local std::map<std::string, std::vector<std::pair<double, double>>>
+      cache;
+  auto cached(cache.find(text));
+  if(cached != cache.end())
+    return cached->second;
+  if(cache.size() >= 1024)
+    cache.clear();
+  std::vector<std::pair<double, double>>& path(cache[text]);
+  const std::pair<double, double> penup(
+      std::numeric_limits<double>::quiet_NaN(), 0.0);
+  double x0(0);
+  for(char ch : text) {
+    uint8_t c(ch);
+    if((c >= 128) || !stroke_font.defined[c])
+      c = '?';
+    for(uint8_t k = 0; k < stroke_font.count[c]; ++k)
+      if(stroke_font.x[c][k] < 0)
+        path.push_back(penup);
+      else
+        path.push_back({x0 + unit * stroke_font.x[c][k],
+                        unit * (2 - stroke_font.y[c][k])});
+    path.push_back(penup);
+    x0 += unit * STROKE_GLYPH_ADVANCE;
+  }
+  return path;
+}
+
+// key of recorded page elements: instrument hash and element:
+typedef std::pair<uint64_t, uint32_t> replay_key_t;
+
+/**
+   Drawing backend of a page, in mm. Elements are drawn into
+   operation layers, holes are filled and all other elements are
+   stroked in the layer colour.
+ */
+class page_backend_t {
+public:
+  virtual ~page_backend_t() = default;
+  virtual void begin_layer(layer_t layer, uint32_t colour) = 0;
+  virtual void end_layer() = 0;
+  virtual void rectangle(double x, double y, double w, double h) = 0;
+  virtual void line(double x1, double y1, double x2, double y2) = 0;
+  virtual void stroke_text(double x, double y, const std::string& text) = 0;
+  /**
+     Draw page invariant elements of the current layer. Backends may
+     record them once per thread and key, and replay the recording.
+   */
+  virtual void replay(const replay_key_t& key,
+                      const std::function<void(page_backend_t&)>& draw) = 0;
+};
+
+/**
+   Backend drawing into a Cairo context.
+ */
+class cairo_backend_t : public page_backend_t {
+public:
+  cairo_backend_t(const Cairo::RefPtr<Cairo::Context>& cr);
+  void begin_layer(layer_t layer, uint32_t colour);
+  void end_layer();
+  void rectangle(double x, double y, double w, double h);
+  void line(double x1, double y1, double x2, double y2);
+  void stroke_text(double x, double y, const std::string& text);
+  void replay(const replay_key_t& key,
+              const std::function<void(page_backend_t&)>& draw);
+
+private:
+  Cairo::RefPtr<Cairo::Context> cr;
+  layer_t layer;
+  uint32_t colour;
+};
+
+cairo_backend_t::cairo_backend_t(const Cairo::RefPtr<Cairo::Context>& cr)
+    : cr(cr), layer(LAYER_CUT_HOLES), colour(0)
+{
+}
+
+void cairo_backend_t::begin_layer(layer_t newlayer, uint32_t newcolour)
+{
+  layer = newlayer;
+  colour = newcolour;
+  cr->save();
+  cr->set_line_width(0.1);
+  cr->set_source_rgb(((colour >> 16) & 0xff) / 255.0,
+                     ((colour >> 8) & 0xff) / 255.0, (colour & 0xff) / 255.0);
+}
+
+void cairo_backend_t::end_layer()
+{
+  cr->restore();
+}
+
+void cairo_backend_t::rectangle(double x, double y, double w, double h)
+{
+  cr->rectangle(x, y, w, h);
+  cr->fill();
+}
+
+void cairo_backend_t::line(double x1, double y1, double x2, double y2)
+{
+  cr->move_to(x1, y1);
+  cr->line_to(x2, y2);
+  cr->stroke();
+}
+
+void cairo_backend_t::stroke_text(double x, double y, const std::string& text)
+{
+  bool pendown(false);
+  for(const auto& p : stroke_text_path(text)) {
+    if(std::isnan(p.first))
+      pendown = false;
+    else if(pendown)
+      cr->line_to(x + p.first, y + p.second);
+    else {
+      cr->move_to(x + p.first, y + p.second);
+      pendown = true;
+    }
+  }
+  cr->stroke();
+}
+
+/**
+   Replay a recording surface. Cairo surfaces must not be used by
+   several threads at once, so each thread keeps its own recordings.
+ */
+void cairo_backend_t::replay(const replay_key_t& key,
+                             const std::function<void(page_backend_t&)>& draw)
+{
+  thread_local std::map<std::pair<replay_key_t, uint32_t>,
+                        Cairo::RefPtr<Cairo::RecordingSurface>>
+      recordings;
+  auto& recording(recordings[{key, colour}]);
+  if(!recording) {
+    recording = Cairo::RecordingSurface::create();
+    cairo_backend_t recorder(Cairo::Context::create(recording));
+    recorder.begin_layer(layer, colour);
+    draw(recorder);
+    recorder.end_layer();
+  }
+  cr->save();
+  cr->set_source(recording, 0, 0);
+  cr->paint();
+  cr->restore();
+}
+
+/**
+   Native SVG backend, which writes each operation layer as an
+   Inkscape layer group. Coordinates are in mm.
+
+   In instanced mode each distinct hole shape is defined once as a
+   symbol, and the holes are placed as uses of it.
+ */
+class svg_writer_t : public page_backend_t {
 public:
-  midi2svg_t(const std::string& cfgfile);
-  void read(const std::string& midifile);
-  void output_svg();
-  void generate_svg(const std::string& svgname, double offset_mm);
+  svg_writer_t(double width, double height, bool instanced = false);
+  std::string finish();
+  void begin_layer(layer_t layer, uint32_t colour);
+  void end_layer();
+  void rectangle(double x, double y, double w, double h);
+  void line(double x1, double y1, double x2, double y2);
+  void stroke_text(double x, double y, const std::string& text);
+  void replay(const replay_key_t& key,
+              const std::function<void(page_backend_t&)>& draw);
 
 private:
-  bool hasNotes(const smf::MidiEventList& eventlist);
-  smf::MidiFile midifile;
+  svg_writer_t() : instanced(false){};
+  void append(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+  std::string svg;
+  std::string header;
+  bool instanced;
+  // symbol index by hole size in um:
+  std::map<std::pair<int64_t, int64_t>, size_t> symbols;
+};
+
+svg_writer_t::svg_writer_t(double width, double height, bool instanced)
+    : instanced(instanced)
+{
+  append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+         "xmlns:xlink=\"http://www.w3.org/1999/xlink\" "
+         "xmlns:inkscape=\"http://www.inkscape.org/namespaces/inkscape\" "
+         "width=\"%gmm\" height=\"%gmm\" viewBox=\"0 0 %g %g\">\n",
+         width, height, width, height);
+  header.swap(svg);
+}
+
+void svg_writer_t::append(const char* fmt, ...)
+{
+  char ctmp[1024];
+  va_list args;
+  va_start(args, fmt);
+  int n(vsnprintf(ctmp, sizeof(ctmp), fmt, args));
+  va_end(args);
+  svg.append(ctmp, std::min(std::max(n, 0), (int)sizeof(ctmp) - 1));
+}
+
+std::string svg_writer_t::finish()
+{
+  if(!symbols.empty()) {
+    std::vector<std::pair<int64_t, int64_t>> sizes(symbols.size());
+    for(const auto& symbol : symbols)
+      sizes[symbol.second] = symbol.first;
+    svg.swap(header);
+    svg += "<defs>\n";
+    for(size_t k = 0; k < sizes.size(); ++k)
+      append("<symbol id=\"h%zu\" overflow=\"visible\">"
+             "<rect width=\"%.3f\" height=\"%.3f\"/></symbol>\n",
+             k, 0.001 * sizes[k].first, 0.001 * sizes[k].second);
+    svg += "</defs>\n";
+    svg.swap(header);
+  }
+  header += svg;
+  header += "</svg>\n";
+  svg.clear();
+  return std::move(header);
+}
+
+void svg_writer_t::begin_layer(layer_t layer, uint32_t colour)
+{
+  append("<g id=\"%s\" inkscape:groupmode=\"layer\" inkscape:label=\"%s\" ",
+         layer_names[layer], layer_names[layer]);
+  if(layer == LAYER_CUT_HOLES)
+    append("fill=\"#%06x\" stroke=\"none\">\n", colour);
+  else
+    append("fill=\"none\" stroke=\"#%06x\" stroke-width=\"0.1\">\n", colour);
+}
+
+void svg_writer_t::end_layer()
+{
+  svg += "</g>\n";
+}
+
+void svg_writer_t::rectangle(double x, double y, double w, double h)
+{
+  if(instanced) {
+    auto symbol(symbols
+                    .emplace(std::make_pair(llround(1000 * w),
+                                            llround(1000 * h)),
+                             symbols.size())
+                    .first);
+    append("<use xlink:href=\"#h%zu\" x=\"%.3f\" y=\"%.3f\"/>\n",
+           symbol->second, x, y);
+    return;
+  }
+  append("<rect x=\"%.3f\" y=\"%.3f\" width=\"%.3f\" height=\"%.3f\"/>\n", x,
+         y, w, h);
+}
+
+void svg_writer_t::line(double x1, double y1, double x2, double y2)
+{
+  append("<path d=\"M%.3f %.3fL%.3f %.3f\"/>\n", x1, y1, x2, y2);
+}
+
+void svg_writer_t::stroke_text(double x, double y, const std::string& text)
+{
+  svg += "<path d=\"";
+  char cmd('M');
+  for(const auto& p : stroke_text_path(text)) {
+    if(std::isnan(p.first))
+      cmd = 'M';
+    else {
+      append("%c%.3f %.3f", cmd, x + p.first, y + p.second);
+      cmd = 'L';
+    }
+  }
+  svg += "\"/>\n";
+}
+
+// elements are cached as SVG text per thread:
+void svg_writer_t::replay(const replay_key_t& key,
+                          const std::function<void(page_backend_t&)>& draw)
+{
+  thread_local std::map<replay_key_t, std::string> fragments;
+  auto fragment(fragments.find(key));
+  if(fragment == fragments.end()) {
+    svg_writer_t recorder;
+    draw(recorder);
+    fragment = fragments.emplace(key, std::move(recorder.svg)).first;
+  }
+  svg += fragment->second;
+}
+
+/**
+   DXF backend, which streams POLYLINE and LINE entities straight into
+   the output, with one DXF layer per operation layer. The file is
+   written as AutoCAD R12 (AC1009) DXF, which needs no object handles
+   and is read by most cutter software. The y axis of DXF points up, so
+   coordinates are flipped at the page height.
+ */
+class dxf_writer_t : public page_backend_t {
+public:
+  dxf_writer_t(std::ostream& os, double height, const uint32_t* colours);
+  void finish();
+  void begin_layer(layer_t layer, uint32_t colour);
+  void end_layer(){};
+  void rectangle(double x, double y, double w, double h);
+  void line(double x1, double y1, double x2, double y2);
+  void stroke_text(double x, double y, const std::string& text);
+  void replay(const replay_key_t& key,
+              const std::function<void(page_backend_t&)>& draw);
+
+private:
+  dxf_writer_t(std::ostream& os, double height, layer_t layer)
+      : os(os), height(height), layer(layer){};
+  void group(int code, const char* value);
+  void group(int code, double value);
+  void polyline(const std::vector<std::pair<double, double>>& points,
+                bool closed);
+  std::ostream& os;
+  double height;
+  layer_t layer;
+};
+
+// nearest of the basic AutoCAD colour indices, 7 is black or white:
+int dxf_colour_index(uint32_t colour)
+{
+  int r((colour >> 16) & 0xff);
+  int g((colour >> 8) & 0xff);
+  int b(colour & 0xff);
+  // index by presence of the red, green and blue component:
+  static const int aci[8] = {7, 5, 3, 4, 1, 6, 2, 7};
+  return aci[((r >= 128) << 2) | ((g >= 128) << 1) | (b >= 128)];
+}
+
+dxf_writer_t::dxf_writer_t(std::ostream& os, double height,
+                           const uint32_t* colours)
+    : os(os), height(height), layer(LAYER_CUT_HOLES)
+{
+  group(0, "SECTION");
+  group(2, "HEADER");
+  group(9, "$ACADVER");
+  group(1, "AC1009");
+  group(0, "ENDSEC");
+  group(0, "SECTION");
+  group(2, "TABLES");
+  // the line type used by the layers:
+  group(0, "TABLE");
+  group(2, "LTYPE");
+  group(70, "1");
+  group(0, "LTYPE");
+  group(2, "CONTINUOUS");
+  group(70, "0");
+  group(3, "Solid line");
+  group(72, "65");
+  group(73, "0");
+  group(40, 0.0);
+  group(0, "ENDTAB");
+  // R12 layers only have the basic colour indices:
+  group(0, "TABLE");
+  group(2, "LAYER");
+  group(70, std::to_string(LAYER_COUNT).c_str());
+  for(int k = 0; k < LAYER_COUNT; ++k) {
+    group(0, "LAYER");
+    group(2, layer_names[k]);
+    group(70, "0");
+    group(62, std::to_string(dxf_colour_index(colours[k])).c_str());
+    group(6, "CONTINUOUS");
+  }
+  group(0, "ENDTAB");
+  group(0, "ENDSEC");
+  group(0, "SECTION");
+  group(2, "ENTITIES");
+}
+
+void dxf_writer_t::finish()
+{
+  group(0, "ENDSEC");
+  group(0, "EOF");
+  os.flush();
+}
+
+void dxf_writer_t::group(int code, const char* value)
+{
+  os << code << '\n' << value << '\n';
+}
+
+void dxf_writer_t::group(int code, double value)
+{
+  char ctmp[32];
+  snprintf(ctmp, sizeof(ctmp), "%.3f", value);
+  group(code, ctmp);
+}
+
+void dxf_writer_t::begin_layer(layer_t newlayer, uint32_t)
+{
+  layer = newlayer;
+}
+
+void dxf_writer_t::polyline(
+    const std::vector<std::pair<double, double>>& points, bool closed)
+{
+  group(0, "POLYLINE");
+  group(8, layer_names[layer]);
+  group(66, "1"); // vertices follow
+  group(10, 0.0);
+  group(20, 0.0);
+  group(30, 0.0);
+  group(70, closed ? "1" : "0");
+  for(const auto& p : points) {
+    group(0, "VERTEX");
+    group(8, layer_names[layer]);
+    group(10, p.first);
+    group(20, height - p.second);
+    group(30, 0.0);
+  }
+  group(0, "SEQEND");
+  group(8, layer_names[layer]);
+}
+
+void dxf_writer_t::rectangle(double x, double y, double w, double h)
+{
+  polyline({{x, y}, {x + w, y}, {x + w, y + h}, {x, y + h}}, true);
+}
+
+void dxf_writer_t::line(double x1, double y1, double x2, double y2)
+{
+  group(0, "LINE");
+  group(8, layer_names[layer]);
+  group(10, x1);
+  group(20, height - y1);
+  group(30, 0.0);
+  group(11, x2);
+  group(21, height - y2);
+  group(31, 0.0);
+}
+
+// each stroke of the text is an open polyline:
+void dxf_writer_t::stroke_text(double x, double y, const std::string& text)
+{
+  std::vector<std::pair<double, double>> stroke;
+  for(const auto& p : stroke_text_path(text)) {
+    if(!std::isnan(p.first)) {
+      stroke.push_back({x + p.first, y + p.second});
+      continue;
+    }
+    if(stroke.size() > 1)
+      polyline(stroke, false);
+    stroke.clear();
+  }
+}
+
+// entities are cached as DXF text per thread:
+void dxf_writer_t::replay(const replay_key_t& key,
+                          const std::function<void(page_backend_t&)>& draw)
+{
+  thread_local std::map<replay_key_t, std::string> fragments;
+  auto& fragment(fragments[key]);
+  if(fragment.empty()) {
+    std::ostringstream recording;
+    dxf_writer_t recorder(recording, height, layer);
+    draw(recorder);
+    fragment = recording.str();
+  }
+  os << fragment;
+}
+
+// Totals of a cut job:
+struct job_estimate_t {
+  job_estimate_t();
+  double machine_time(const machine_t& machine) const;
+  uint32_t pages;
+  size_t holes;
+  size_t pierces;        // paths, each started by a pierce
+  double cutlength;      // mm, holes and edges
+  double engravelength;  // mm, labels and marks
+  double travellength;   // mm, between the end and start of paths
+  double materiallength; // mm
+};
+
+job_estimate_t::job_estimate_t()
+    : pages(0), holes(0), pierces(0), cutlength(0), engravelength(0),
+      travellength(0), materiallength(0)
+{
+}
+
+// estimated machine time in seconds:
+double job_estimate_t::machine_time(const machine_t& machine) const
+{
+  return (cutlength + engravelength) / machine.cutspeed +
+         travellength / machine.travelspeed + pierces * machine.piercetime;
+}
+
+/**
+   Backend which does not draw, but adds up the paths of a page for
+   the cut job estimate. Paths are assumed to be cut in drawing order,
+   starting at the page origin.
+ */
+class estimate_backend_t : public page_backend_t {
+public:
+  estimate_backend_t(job_estimate_t& total)
+      : total(total), layer(LAYER_CUT_HOLES), pos(0.0, 0.0){};
+  void begin_layer(layer_t newlayer, uint32_t) { layer = newlayer; };
+  void end_layer(){};
+  void rectangle(double x, double y, double w, double h);
+  void line(double x1, double y1, double x2, double y2);
+  void stroke_text(double x, double y, const std::string& text);
+  void replay(const replay_key_t&,
+              const std::function<void(page_backend_t&)>& draw)
+  {
+    draw(*this);
+  };
+
+private:
+  void path(double x1, double y1, double x2, double y2, double length);
+  job_estimate_t& total;
+  layer_t layer;
+  std::pair<double, double> pos; // end of the last path
+};
+
+// a path from (x1,y1) to (x2,y2):
+void estimate_backend_t::path(double x1, double y1, double x2, double y2,
+                              double length)
+{
+  total.travellength += std::hypot(x1 - pos.first, y1 - pos.second);
+  ++total.pierces;
+  if((layer == LAYER_CUT_HOLES) || (layer == LAYER_CUT_EDGES))
+    total.cutlength += length;
+  else
+    total.engravelength += length;
+  pos = {x2, y2};
+}
+
+void estimate_backend_t::rectangle(double x, double y, double w, double h)
+{
+  if(layer == LAYER_CUT_HOLES)
+    ++total.holes;
+  path(x, y, x, y, 2 * (w + h));
+}
+
+void estimate_backend_t::line(double x1, double y1, double x2, double y2)
+{
+  path(x1, y1, x2, y2, std::hypot(x2 - x1, y2 - y1));
+}
+
+void estimate_backend_t::stroke_text(double x, double y,
+                                     const std::string& text)
+{
+  std::vector<std::pair<double, double>> stroke;
+  for(const auto& p : stroke_text_path(text)) {
+    if(!std::isnan(p.first)) {
+      stroke.push_back({x + p.first, y + p.second});
+      continue;
+    }
+    if(stroke.size() > 1) {
+      double length(0);
+      for(size_t k = 1; k < stroke.size(); ++k)
+        length += std::hypot(stroke[k].first - stroke[k - 1].first,
+                             stroke[k].second - stroke[k - 1].second);
+      path(stroke.front().first, stroke.front().second, stroke.back().first,
+           stroke.back().second, length);
+    }
+    stroke.clear();
+  }
+}
+
+class midi2svg_t : public instrument_t {
+public:
+  midi2svg_t(
+      const instrument_t& instrument, const output_cfg_t& cfg,
+      std::pmr::memory_resource* arena = std::pmr::get_default_resource());
+  void add_notes(const std::string& midifile,
+                 const std::pmr::vector<note_t>& decoded);
+  bool load_cached(const std::string& midifile, uint64_t midihash);
+  void save_cached(uint64_t midihash);
+  void set_tag(const std::string& newtag) { tag = newtag; };
+  void set_route(const tape_route_t& newroute);
+  void compute_layout();
+  uint32_t pages() const;
+  void convert_stream(const std::string& midifile);
+  void output_page(uint32_t page, double offset_mm);
+  void render_page(uint32_t page, double offset_mm,
+                   rect_buffer_t& pagerects) const;
+  void compute_rects(double offset_mm, rect_buffer_t& pagerects) const;
+  void render_format(uint32_t page, double offset_mm, const std::string& format,
+                     const rect_buffer_t& pagerects) const;
+  void output_overview();
+  job_estimate_t estimate() const;
+  std::string estimate_report() const;
+  void generate_svg(const std::string& svgname, double offset_mm,
+                    const rect_buffer_t& pagerects) const;
+  void generate_png(const std::string& pngname, double offset_mm,
+                    const rect_buffer_t& pagerects) const;
+  void generate_dxf(const std::string& dxfname, double offset_mm,
+                    const rect_buffer_t& pagerects) const;
+  void generate_pdf(const std::string& pdfname, double offset_mm,
+                    const rect_buffer_t& pagerects) const;
+  void finish_output();
+  const std::pmr::string& get_log() const { return log; };
+
+private:
+  void draw_page(page_backend_t& page, const std::string& label,
+                 double offset_mm, const rect_buffer_t& pagerects) const;
+  void draw_edges(page_backend_t& page) const;
+  void draw_marks(page_backend_t& page) const;
+  std::string output_base() const;
+  std::string cache_name(uint64_t midihash) const;
+  void update_layouthash();
+  std::string page_name(uint32_t page, const std::string& format) const;
+  void write_file(const std::string& name, std::string&& data) const;
+  double note_end(const note_t& note) const;
+  void add_note(const note_t& note);
+  bool load_layout(const std::string& fname, uint64_t midihash,
+                   uint64_t cfghash);
+  void save_layout(const std::string& fname, uint64_t midihash,
+                   uint64_t cfghash);
   // xercesc::DOMDocument* doc;
-  std::map<int, double> pitches;
-  double paperwidth;     // mm
-  double maxpaperlength; // mm
-  double notewidth;      // mm
-  double speed;          // mm/s
-  double minnotelength;  // mm
-  double maxnotelength;  // mm
-  double mingaplength;   // mm
-  bool cuthighedge;
-  bool cutlowedge;
-  bool cutend;
-  double offset;        // mm
-  double presilence;    // seconds
-  double postsilence;   // seconds
   double musicduration; // seconds
-  std::list<note_t> notes;
-  std::string filename;
+  // notes are retired in streaming mode, so recycle their memory:
+  std::pmr::unsynchronized_pool_resource pool;
+  std::pmr::list<note_t> notes;
+  note_arrays_t note_arrays;
+  layout_t layout;
+  rect_buffer_t rects; // rectangles of the current page
+  std::pmr::string filename;
+  std::string tag; // appended to the output names
+  std::pmr::string log;
+  output_cfg_t out;
+  uint64_t instrumenthash; // key of recorded page elements
+  tape_route_t route;      // selects the notes of this tape
+  uint64_t layouthash;     // key of cached layouts
 };
 
 std::string notename_de(int pitch, bool flat = true)
@@ -157,15 +1949,90 @@ std::string notename_de(int pitch, bool flat = true)
   return retv;
 }
 
-int name_de2pitch(const std::string& n)
+[[noreturn]] void throw_note_name_error(std::string_view n, const char* lang)
+{
+  throw std::runtime_error("invalid " + std::string(lang) + " note name \"" +
+                           std::string(n) + "\"");
+}
+
+/**
+   Parse a German note name in Helmholtz notation, e.g. "C1", "As",
+   "fis'" or "b''". "is" raises and "es" (or "s" after "a" and "e")
+   lowers by a semitone, both may be repeated. Upper case names are
+   in the great octave, a number or commas lower them further. Lower
+   case names are in the small octave, each "'" (or a number) raises
+   them by an octave. Throws on names which can not be parsed.
+ */
+constexpr int name_de2pitch(std::string_view n)
 {
-  for(int k = 0; k < 127; ++k) {
-    if(notename_de(k) == n)
-      return k;
-    if(notename_de(k, false) == n)
-      return k;
+  if(n.empty())
+    throw_note_name_error(n, "German");
+  char c(n[0]);
+  bool upper((c >= 'A') && (c <= 'Z'));
+  if(upper)
+    c += 32;
+  int pitch(0);
+  switch(c) {
+  case 'c':
+    pitch = 0;
+    break;
+  case 'd':
+    pitch = 2;
+    break;
+  case 'e':
+    pitch = 4;
+    break;
+  case 'f':
+    pitch = 5;
+    break;
+  case 'g':
+    pitch = 7;
+    break;
+  case 'a':
+    pitch = 9;
+    break;
+  case 'b':
+    pitch = 10;
+    break;
+  case 'h':
+    pitch = 11;
+    break;
+  default:
+    throw_note_name_error(n, "German");
   }
-  return 0;
+  size_t pos(1);
+  int acc(0);
+  if(((c == 'a') || (c == 'e')) && (n.substr(pos, 1) == "s") &&
+     (n.substr(pos, 2) != "is")) {
+    --acc;
+    ++pos;
+  }
+  while(c != 'b') {
+    if((n.substr(pos, 2) == "is") && (acc >= 0))
+      ++acc;
+    else if((n.substr(pos, 2) == "es") && (acc <= 0))
+      --acc;
+    else
+      break;
+    pos += 2;
+  }
+  pitch += acc;
+  int octave(upper ? 3 : 4);
+  if((pos < n.size()) && (n[pos] >= '0') && (n[pos] <= '9')) {
+    int num(0);
+    while((pos < n.size()) && (n[pos] >= '0') && (n[pos] <= '9'))
+      num = 10 * num + (n[pos++] - '0');
+    octave += upper ? -num : num;
+  } else {
+    while((pos < n.size()) && (n[pos] == (upper ? ',' : '\''))) {
+      octave += upper ? -1 : 1;
+      ++pos;
+    }
+  }
+  pitch += 12 * octave;
+  if((pos != n.size()) || (pitch < 0) || (pitch > 127))
+    throw_note_name_error(n, "German");
+  return pitch;
 }
 
 std::string notename_en(int pitch, bool flat = true)
@@ -229,16 +2096,197 @@ std::string notename_en(int pitch, bool flat = true)
   return retv;
 }
 
-int name_en2pitch(const std::string& n)
+/**
+   Parse an English note name in scientific pitch notation, e.g. "C4",
+   "Bb3", "F#-1". "#" raises and "b" lowers by a semitone, both may be
+   repeated. Throws on names which can not be parsed.
+ */
+constexpr int name_en2pitch(std::string_view n)
 {
-  for(int k = 0; k < 127; ++k) {
-    if(notename_en(k) == n)
-      return k;
-    if(notename_en(k, false) == n)
-      return k;
+  if(n.empty())
+    throw_note_name_error(n, "English");
+  char c(n[0]);
+  if((c >= 'a') && (c <= 'z'))
+    c -= 32;
+  int pitch(0);
+  switch(c) {
+  case 'C':
+    pitch = 0;
+    break;
+  case 'D':
+    pitch = 2;
+    break;
+  case 'E':
+    pitch = 4;
+    break;
+  case 'F':
+    pitch = 5;
+    break;
+  case 'G':
+    pitch = 7;
+    break;
+  case 'A':
+    pitch = 9;
+    break;
+  case 'B':
+    pitch = 11;
+    break;
+  default:
+    throw_note_name_error(n, "English");
   }
-  return 0;
+  size_t pos(1);
+  while((pos < n.size()) && ((n[pos] == '#') || (n[pos] == 'b'))) {
+    if((n[pos] != n[1]))
+      throw_note_name_error(n, "English");
+    pitch += (n[pos] == '#') ? 1 : -1;
+    ++pos;
+  }
+  bool negative((pos < n.size()) && (n[pos] == '-'));
+  if(negative)
+    ++pos;
+  if((pos == n.size()) || (n[pos] < '0') || (n[pos] > '9'))
+    throw_note_name_error(n, "English");
+  int octave(0);
+  while((pos < n.size()) && (n[pos] >= '0') && (n[pos] <= '9'))
+    octave = 10 * octave + (n[pos++] - '0');
+  if(negative)
+    octave = -octave;
+  pitch += 12 * (octave + 1);
+  if((pos != n.size()) || (pitch < 0) || (pitch > 127))
+    throw_note_name_error(n, "English");
+  return pitch;
+}
+
+// Dense lane table of a built-in instrument, indexed by MIDI pitch:
+struct lane_table_t {
+  double pos[128];
+  bool used[128];
+};
+
+struct lane_range_t {
+  int start;
+  int end;
+  double p0;
+  double dp;
+};
+
+template <size_t N>
+constexpr lane_table_t lanes_range(const lane_range_t (&ranges)[N])
+{
+  lane_table_t lanes{};
+  for(const auto& range : ranges)
+    for(int pitch = range.start; pitch <= range.end; ++pitch) {
+      lanes.pos[pitch] = range.p0 + (pitch - range.start) * range.dp;
+      lanes.used[pitch] = true;
+    }
+  return lanes;
+}
+
+template <size_t N>
+constexpr lane_table_t lanes_de(const std::string_view (&names)[N],
+                                double p0, double dp)
+{
+  lane_table_t lanes{};
+  for(size_t k = 0; k < N; ++k) {
+    int pitch(name_de2pitch(names[k]));
+    lanes.pos[pitch] = p0 + k * dp;
+    lanes.used[pitch] = true;
+  }
+  return lanes;
+}
+
+struct preset_t {
+  const char* name;
+  const char* description;
+  double paperwidth;
+  double maxpaperlength;
+  double notewidth;
+  double speed;
+  double minnotelength;
+  double maxnotelength;
+  double mingaplength;
+  bool cuthighedge;
+  bool cutlowedge;
+  bool cutend;
+  double offset;
+  double presilence;
+  double postsilence;
+  lane_table_t lanes;
+};
+
+constexpr std::string_view musicbox15_names[] = {
+    "c''",  "d''",  "e''",  "f''",  "g''",  "a''",  "h''",  "c'''",
+    "d'''", "e'''", "f'''", "g'''", "a'''", "h'''", "c''''"};
+
+constexpr std::string_view musicbox20_names[] = {
+    "c'",   "d'",   "g'",   "a'",   "h'",   "c''",  "d''",
+    "e''",  "f''",  "g''",  "a''",  "h''",  "c'''", "d'''",
+    "e'''", "f'''", "g'''", "a'''", "h'''", "c''''"};
+
+constexpr std::string_view organ20_names[] = {
+    "F",  "B",  "c",   "d",  "es", "e",  "f",  "g",  "a",   "b",
+    "c'", "d'", "es'", "e'", "f'", "g'", "a'", "b'", "c''", "d''"};
+
+constexpr std::string_view organ26_names[] = {
+    "C",  "F",    "G",  "A",  "B",  "c",    "d",  "e",  "f",
+    "fis", "g",   "a",  "b",  "h",  "c'",   "cis'", "d'", "e'",
+    "f'", "fis'", "g'", "a'", "b'", "h'",   "c''", "d''"};
+
+constexpr std::string_view organ31_names[] = {
+    "F",   "G",   "A",     "B",   "c",   "d",    "e",  "f",
+    "fis", "g",   "a",     "b",   "h",   "c'",   "cis'", "d'",
+    "es'", "e'",  "f'",    "fis'", "g'", "gis'", "a'", "b'",
+    "h'",  "c''", "cis''", "d''", "e''", "f''",  "g''"};
+
+constexpr lane_range_t musicbox30_ranges[] = {
+    {53, 53, 6, 2},  {55, 55, 8, 2},  {61, 61, 10, 2},
+    {63, 63, 12, 2}, {65, 66, 14, 2}, {68, 68, 18, 2},
+    {70, 90, 20, 2}, {92, 92, 62, 2}, {94, 94, 64, 2}};
+
+constexpr lane_range_t piano_ranges[] = {{21, 108, 6, 2}};
+
+constexpr lane_range_t pianoroll65_ranges[] = {{33, 97, 7.4, 25.4 / 6}};
+
+constexpr lane_range_t pianoroll88_ranges[] = {{21, 108, 20.1, 25.4 / 9}};
+
+// Built-in instruments. The geometry of "musicbox30" and "organ20"
+// matches the configurations in the examples directory, "piano" uses
+// the lanes of the piano example on a strip which holds all of them.
+constexpr preset_t presets[] = {
+    {"musicbox15", "15 note music box, 41 mm strip", 41, 210, 1.5, 14, 2, 2, 6,
+     false, false, true, 0, 0, 3, lanes_de(musicbox15_names, 6.5, 2)},
+    {"musicbox20", "20 note music box, 57 mm strip", 57, 210, 1.5, 14, 2, 2, 6,
+     false, false, true, 0, 0, 3, lanes_de(musicbox20_names, 6.5, 2.3)},
+    {"musicbox30", "30 note music box, 70 mm strip", 70, 210, 1.5, 14, 2, 2, 6,
+     false, false, true, 12.5, 0, 3, lanes_range(musicbox30_ranges)},
+    {"organ20", "20 note barrel organ", 110.15, 210, 2, 8, 2, 20, 0.3, true,
+     false, false, 0, 3, 0, lanes_de(organ20_names, 10, 3.85)},
+    {"organ26", "26 note barrel organ", 120, 210, 2, 8, 2, 20, 0.3, true,
+     false, false, 0, 3, 0, lanes_de(organ26_names, 10, 3.85)},
+    {"organ31", "31 note barrel organ", 140, 210, 2, 8, 2, 20, 0.3, true,
+     false, false, 0, 3, 0, lanes_de(organ31_names, 12, 3.85)},
+    {"piano", "full piano range, 2 mm lanes, 186 mm strip", 186, 210, 1.8, 8, 2,
+     2, 6, false, false, false, 0, 0, 0, lanes_range(piano_ranges)},
+    {"pianoroll65", "65 note player piano roll, 11.25 inch", 285.75, 210, 1.6,
+     35.56, 2, 10000, 1.5, false, false, true, 0, 3, 3,
+     lanes_range(pianoroll65_ranges)},
+    {"pianoroll88", "88 note player piano roll, 11.25 inch", 285.75, 210, 1.4,
+     35.56, 2, 10000, 1.5, false, false, true, 0, 3, 3,
+     lanes_range(pianoroll88_ranges)}};
+
+// all holes of a built-in instrument must lie on its strip:
+constexpr bool presets_on_strip()
+{
+  for(const auto& preset : presets)
+    for(int pitch = 0; pitch < 128; ++pitch)
+      if(preset.lanes.used[pitch] &&
+         ((preset.lanes.pos[pitch] < 0.5 * preset.notewidth) ||
+          (preset.lanes.pos[pitch] + 0.5 * preset.notewidth >
+           preset.paperwidth)))
+        return false;
+  return true;
 }
+static_assert(presets_on_strip(), "built-in instrument with lanes off strip");
 
 std::string pitch2name(int pitch)
 {
@@ -253,7 +2301,7 @@ std::string pitch2name(int pitch)
   return retv + " " + dretv;
 }
 
-midi2svg_t::midi2svg_t(const std::string& cfgfile)
+instrument_t::instrument_t()
     : paperwidth(70),      // mm
       maxpaperlength(210), // mm
       notewidth(1.8),      // mm
@@ -262,11 +2310,254 @@ midi2svg_t::midi2svg_t(const std::string& cfgfile)
       maxnotelength(2),    // mm
       mingaplength(6),     // mm
       cuthighedge(false), cutlowedge(false), cutend(false), offset(0.0),
-      presilence(0), postsilence(0), musicduration(0)
+      presilence(0), postsilence(0)
+{
+}
+
+/**
+   Copy an instrument, with the lane map allocated from the given
+   memory resource.
+ */
+instrument_t::instrument_t(const instrument_t& src,
+                           std::pmr::memory_resource* mr)
+    : pitches(mr)
+{
+  // copy assignment keeps the memory resource of pitches:
+  *this = src;
+}
+
+void instrument_t::list_pitches() const
+{
+  size_t k(0);
+  for(auto pitch : pitches) {
+    ++k;
+    std::cout << k << ". " << pitch2name(pitch.first) << " at " << pitch.second
+              << " mm\n";
+  }
+}
+
+/**
+   Load an instrument configuration. A compiled profile next to the
+   JSON file is used instead of parsing the JSON if its source hash
+   matches. Compiled profiles can also be passed directly.
+ */
+void instrument_t::load(const std::string& cfgfile)
+{
+  if(!std::ifstream(cfgfile))
+    throw std::runtime_error("unable to read instrument configuration");
+  std::string config(get_file_contents(cfgfile));
+  if(config.compare(0, 4, PROFILE_MAGIC) == 0) {
+    if(!read_profile(config, 0))
+      throw std::runtime_error("invalid instrument profile " + cfgfile);
+    return;
+  }
+  uint64_t srchash(fnv1a(config));
+  if(read_profile(get_file_contents(cfgfile + PROFILE_EXT), srchash))
+    return;
+  read_json(config);
+}
+
+/**
+   Read compiled profile data, return false if the data is not a
+   valid profile or if it does not match the given source hash (zero
+   matches any source).
+ */
+bool instrument_t::read_profile(const std::string& data, uint64_t srchash)
+{
+  profile_t prof;
+  if(data.size() < sizeof(prof))
+    return false;
+  memcpy(&prof, data.data(), sizeof(prof));
+  if((memcmp(prof.magic, PROFILE_MAGIC, 4) != 0) ||
+     (prof.version != PROFILE_VERSION))
+    return false;
+  if((srchash && (prof.srchash != srchash)) ||
+     (data.size() != sizeof(prof) + prof.routeslength))
+    return false;
+  // corrupt routes make the profile invalid like any other corruption:
+  routes.clear();
+  if(prof.routeslength) {
+    try {
+      read_routes(nlohmann::json::parse(data.substr(sizeof(prof))));
+    }
+    catch(const std::exception&) {
+      routes.clear();
+      return false;
+    }
+  }
+  paperwidth = prof.paperwidth;
+  maxpaperlength = prof.maxpaperlength;
+  notewidth = prof.notewidth;
+  speed = prof.speed;
+  minnotelength = prof.minnotelength;
+  maxnotelength = prof.maxnotelength;
+  mingaplength = prof.mingaplength;
+  offset = prof.offset;
+  presilence = prof.presilence;
+  postsilence = prof.postsilence;
+  cuthighedge = prof.cuthighedge;
+  cutlowedge = prof.cutlowedge;
+  cutend = prof.cutend;
+  pitches.clear();
+  for(int pitch = 0; pitch < 128; ++pitch)
+    if(!std::isnan(prof.lanes[pitch]))
+      pitches[pitch] = prof.lanes[pitch];
+  return true;
+}
+
+/**
+   Convert a JSON instrument configuration into a binary profile,
+   stored next to the source file.
+ */
+void instrument_t::compile(const std::string& cfgfile)
+{
+  std::string config(get_file_contents(cfgfile));
+  read_json(config);
+  profile_t prof(profile());
+  prof.srchash = fnv1a(config);
+  // the routing rules follow as JSON text:
+  std::string js_routes;
+  if(!routes.empty()) {
+    nlohmann::json js(nlohmann::json::array());
+    for(const auto& route : routes)
+      js.push_back(route.to_json());
+    js_routes = js.dump();
+  }
+  prof.routeslength = js_routes.size();
+  std::ofstream ofs(cfgfile + PROFILE_EXT, std::ios::binary);
+  ofs.write((const char*)&prof, sizeof(prof));
+  ofs.write(js_routes.data(), js_routes.size());
+  if(!ofs.good())
+    throw std::runtime_error("unable to write profile " + cfgfile +
+                             PROFILE_EXT);
+}
+
+// Binary representation of the effective instrument settings, without
+// the routing rules:
+profile_t instrument_t::profile() const
+{
+  profile_t prof;
+  memset(&prof, 0, sizeof(prof));
+  memcpy(prof.magic, PROFILE_MAGIC, 4);
+  prof.version = PROFILE_VERSION;
+  prof.paperwidth = paperwidth;
+  prof.maxpaperlength = maxpaperlength;
+  prof.notewidth = notewidth;
+  prof.speed = speed;
+  prof.minnotelength = minnotelength;
+  prof.maxnotelength = maxnotelength;
+  prof.mingaplength = mingaplength;
+  prof.offset = offset;
+  prof.presilence = presilence;
+  prof.postsilence = postsilence;
+  prof.cuthighedge = cuthighedge;
+  prof.cutlowedge = cutlowedge;
+  prof.cutend = cutend;
+  for(int pitch = 0; pitch < 128; ++pitch)
+    prof.lanes[pitch] = std::numeric_limits<double>::quiet_NaN();
+  for(auto pitch : pitches)
+    if((pitch.first >= 0) && (pitch.first < 128))
+      prof.lanes[pitch.first] = pitch.second;
+  return prof;
+}
+
+// Hash of the effective instrument settings:
+uint64_t instrument_t::hash() const
+{
+  profile_t prof(profile());
+  return fnv1a(std::string((const char*)&prof, sizeof(prof)));
+}
+
+/**
+   Load a built-in instrument, without reading any file.
+ */
+void instrument_t::load_preset(const std::string& name)
+{
+  for(const auto& preset : presets) {
+    if(name == preset.name) {
+      paperwidth = preset.paperwidth;
+      maxpaperlength = preset.maxpaperlength;
+      notewidth = preset.notewidth;
+      speed = preset.speed;
+      minnotelength = preset.minnotelength;
+      maxnotelength = preset.maxnotelength;
+      mingaplength = preset.mingaplength;
+      cuthighedge = preset.cuthighedge;
+      cutlowedge = preset.cutlowedge;
+      cutend = preset.cutend;
+      offset = preset.offset;
+      presilence = preset.presilence;
+      postsilence = preset.postsilence;
+      pitches.clear();
+      for(int pitch = 0; pitch < 128; ++pitch)
+        if(preset.lanes.used[pitch])
+          pitches[pitch] = preset.lanes.pos[pitch];
+      routes.clear();
+      return;
+    }
+  }
+  throw std::runtime_error("unknown instrument \"" + name + "\"");
+}
+
+/**
+   Parse the routing rules of a configuration, a list of tapes with a
+   name and the "tracks" and "channels" (counted from 1) whose notes
+   are cut into that tape.
+ */
+void instrument_t::read_routes(const nlohmann::json& js_routes)
+{
+  routes.clear();
+  for(auto js_route : js_routes) {
+    tape_route_t route;
+    parse_js_value(js_route, "name", route.name);
+    if(route.name.empty())
+      route.name = "tape" + std::to_string(routes.size() + 1);
+    if(js_route["tracks"].is_array())
+      for(auto track : js_route["tracks"]) {
+        int trk(track.get<int>());
+        if((trk < 0) || (trk > 0xffff))
+          throw std::runtime_error("invalid track " + std::to_string(trk) +
+                                   " in tape \"" + route.name + "\"");
+        route.tracks.push_back(trk);
+      }
+    if(js_route["channels"].is_array())
+      for(auto channel : js_route["channels"]) {
+        int chan(channel.get<int>());
+        if((chan < 1) || (chan > 16))
+          throw std::runtime_error("invalid channel " + std::to_string(chan) +
+                                   " in tape \"" + route.name + "\"");
+        route.channels.push_back(chan - 1);
+      }
+    routes.push_back(route);
+  }
+}
+
+/**
+   Output name tags of the tapes of the instrument, in the order of the
+   routing rules. With named set the instrument name is included, to
+   tell several instruments apart.
+ */
+std::vector<std::string> instrument_t::tape_tags(bool named) const
+{
+  std::string tag(named ? name : "");
+  if(routes.empty())
+    return {tag};
+  std::vector<std::string> tags;
+  for(const auto& route : routes)
+    tags.push_back(tag.empty() ? route.name : tag + "_" + route.name);
+  return tags;
+}
+
+/**
+   Parse a JSON instrument configuration. If the configuration names a
+   built-in "instrument", that is loaded first and the remaining
+   entries override its settings.
+ */
+void instrument_t::read_json(const std::string& config)
 {
-  // parse config file
-  std::string config(get_file_contents(cfgfile));
   nlohmann::json js_cfg(nlohmann::json::parse(config));
+  if(js_cfg.is_object() && js_cfg["instrument"].is_string())
+    load_preset(js_cfg["instrument"].get<std::string>());
 #define PARSEJS(x) parse_js_value(js_cfg, #x, x)
   PARSEJS(paperwidth);
   PARSEJS(maxpaperlength);
@@ -281,8 +2572,11 @@ midi2svg_t::midi2svg_t(const std::string& cfgfile)
   PARSEJS(offset);
   PARSEJS(presilence);
   PARSEJS(postsilence);
+  if(js_cfg.is_object() && js_cfg["tapes"].is_array())
+    read_routes(js_cfg["tapes"]);
   nlohmann::json js_pitches(js_cfg["pitches"]);
   if(js_pitches.is_array()) {
+    pitches.clear();
     for(auto pitchrange : js_pitches) {
       int pstart(0);
       int pend(0);
@@ -302,176 +2596,1393 @@ midi2svg_t::midi2svg_t(const std::string& cfgfile)
       if(pitchrange["names_de"].is_array()) {
         size_t k(0);
         for(auto name : pitchrange["names_de"]) {
-          pitches[name_de2pitch(name)] = pos0 + k * deltapos;
+          pitches[name_de2pitch(name.get<std::string>())] =
+              pos0 + k * deltapos;
           ++k;
         }
       }
       if(pitchrange["names_en"].is_array()) {
         size_t k(0);
         for(auto name : pitchrange["names_en"]) {
-          pitches[name_en2pitch(name)] = pos0 + k * deltapos;
+          pitches[name_en2pitch(name.get<std::string>())] =
+              pos0 + k * deltapos;
           ++k;
         }
       }
     }
   }
-  size_t k(0);
-  for(auto pitch : pitches) {
-    ++k;
-    std::cout << k << ". " << pitch2name(pitch.first) << " at " << pitch.second
-              << " mm\n";
-  }
+}
+
+/**
+   All per-file data (notes, lane map, names and warnings) is
+   allocated from the given memory resource, which allows batch
+   workers to release it wholesale after each file.
+ */
+midi2svg_t::midi2svg_t(const instrument_t& instrument,
+                       const output_cfg_t& cfg,
+                       std::pmr::memory_resource* arena)
+    : instrument_t(instrument, arena), musicduration(0), pool(arena),
+      notes(&pool), note_arrays(&pool), layout(&pool), rects(&pool),
+      filename(arena),
+      log(arena), out(cfg)
+{
   if(pitches.empty())
     throw std::runtime_error("no pitches defined");
+  instrumenthash = hash();
+  update_layouthash();
 }
 
-void midi2svg_t::output_svg()
+// the cached layout depends on the instrument, the routing and the
+// merging of holes:
+void midi2svg_t::update_layouthash()
+{
+  layouthash = instrumenthash;
+  if(!route.name.empty() || out.dedup)
+    layouthash = fnv1a(std::to_string(instrumenthash) +
+                       route.to_json().dump() + (out.dedup ? "dedup" : ""));
+}
+
+/**
+   Restrict the tape to the notes selected by a routing rule. Cached
+   layouts of different tapes are told apart by the rule.
+ */
+void midi2svg_t::set_route(const tape_route_t& newroute)
+{
+  route = newroute;
+  update_layouthash();
+}
+
+// output file name without page number and extension:
+std::string midi2svg_t::output_base() const
+{
+  if(tag.empty())
+    return std::string(filename);
+  return std::string(filename) + "_" + tag;
+}
+
+std::string midi2svg_t::page_name(uint32_t page,
+                                  const std::string& format) const
+{
+  char ctmp[1024];
+  snprintf(ctmp, sizeof(ctmp), "%s_%03d.%s", output_base().c_str(), page,
+           format.c_str());
+  return ctmp;
+}
+
+// end position of a note on the tape in mm:
+double midi2svg_t::note_end(const note_t& note) const
+{
+  double len(note.duration * speed);
+  if(len >= mingaplength)
+    len -= mingaplength;
+  len = std::min(len, maxnotelength);
+  len = std::max(len, minnotelength);
+  return note.time * speed + len;
+}
+
+/**
+   Layout stage: convert all notes into absolute rectangles on the
+   tape, sorted by their start. Pages only translate and clip them.
+ */
+void midi2svg_t::compute_layout()
+{
+  note_arrays.clear();
+  for(const auto& note : notes) {
+    auto lane(pitches.find(note.pitch));
+    if(lane != pitches.end())
+      note_arrays.push_back(note, lane->second);
+  }
+  layout.resize(note_arrays.size());
+  layout_kernel(note_arrays.size(), note_arrays.time.data(),
+                note_arrays.duration.data(), note_arrays.lane.data(),
+                {speed, mingaplength, minnotelength, maxnotelength,
+                 paperwidth - 0.5 * notewidth},
+                layout.x.data(), layout.x2.data(), layout.y.data());
+  layout.sort();
+  if(out.dedup)
+    layout.merge_overlaps();
+}
+
+void midi2svg_t::compute_rects(double offset_mm,
+                               rect_buffer_t& pagerects) const
+{
+  // only rectangles starting less than the longest rectangle before
+  // the page can reach into it:
+  size_t k0(std::lower_bound(layout.x.begin(), layout.x.end(),
+                             offset_mm - layout.maxlength) -
+            layout.x.begin());
+  size_t k1(std::lower_bound(layout.x.begin() + k0, layout.x.end(),
+                             offset_mm + maxpaperlength) -
+            layout.x.begin());
+  pagerects.resize(k1 - k0);
+  page_rects_kernel(k1 - k0, layout.x.data() + k0, layout.x2.data() + k0,
+                    layout.y.data() + k0, offset_mm, maxpaperlength,
+                    pagerects.x.data(), pagerects.y.data(),
+                    pagerects.w.data());
+  compact_rects(pagerects);
+}
+
+void midi2svg_t::output_page(uint32_t page, double offset_mm)
+{
+  render_page(page, offset_mm, rects);
+}
+
+/**
+   Render a page from the layout into a caller-provided rectangle
+   buffer, in all output formats. Pages of the same layout can be
+   rendered concurrently.
+ */
+void midi2svg_t::render_page(uint32_t page, double offset_mm,
+                             rect_buffer_t& pagerects) const
+{
+  compute_rects(offset_mm, pagerects);
+  for(const auto& format : out.formats)
+    render_format(page, offset_mm, format, pagerects);
+}
+
+/**
+   Render the rectangles of a page in one output format. The formats
+   of a page can be rendered concurrently from the same rectangles.
+ */
+void midi2svg_t::render_format(uint32_t page, double offset_mm,
+                               const std::string& format,
+                               const rect_buffer_t& pagerects) const
+{
+  std::string name(page_name(page, format));
+  if(format == "png")
+    generate_png(name, offset_mm, pagerects);
+  else if(format == "pdf")
+    generate_pdf(name, offset_mm, pagerects);
+  else if(format == "dxf")
+    generate_dxf(name, offset_mm, pagerects);
+  else
+    generate_svg(name, offset_mm, pagerects);
+}
+
+/**
+   Estimate the cut job from the layout, by measuring the pages
+   without rendering them.
+ */
+job_estimate_t midi2svg_t::estimate() const
+{
+  job_estimate_t total;
+  total.pages = pages();
+  rect_buffer_t pagerects(std::pmr::get_default_resource());
+  for(uint32_t page = 0; page < total.pages; ++page) {
+    double offset_mm(page * maxpaperlength);
+    estimate_backend_t measure(total);
+    compute_rects(offset_mm, pagerects);
+    draw_page(measure, page_name(page, out.formats.front()), offset_mm,
+              pagerects);
+  }
+  // the last page ends at the end cut:
+  total.materiallength = total.pages * maxpaperlength;
+  if(cutend && total.pages)
+    total.materiallength = musicduration * speed;
+  return total;
+}
+
+// cut job estimate of the tape as text:
+std::string midi2svg_t::estimate_report() const
+{
+  job_estimate_t total(estimate());
+  uint64_t seconds(std::lround(total.machine_time(out.machine)));
+  char ctmp[1024];
+  snprintf(ctmp, sizeof(ctmp),
+           "%s: %u pages, %zu holes, material %.1f mm x %.1f mm\n"
+           "  cut %.1f mm, engrave %.1f mm, travel %.1f mm, %zu pierces\n"
+           "  estimated machine time %u:%02u:%02u\n",
+           output_base().c_str(), total.pages, total.holes,
+           total.materiallength, paperwidth + offset, total.cutlength,
+           total.engravelength, total.travellength, total.pierces,
+           (unsigned)(seconds / 3600), (unsigned)(seconds / 60 % 60),
+           (unsigned)(seconds % 60));
+  return ctmp;
+}
+
+/**
+   Write an overview of the whole tape as a lane occupancy grid with a
+   fixed number of time bins. Each cell holds the fraction of the bin
+   which is punched in that lane, computed in a single pass over the
+   notes.
+ */
+void midi2svg_t::output_overview()
+{
+  // rows are sorted by lane position, highest lane first as on the
+  // pages:
+  std::vector<std::pair<double, int>> lanes;
+  for(auto pitch : pitches)
+    lanes.push_back({pitch.second, pitch.first});
+  std::sort(lanes.rbegin(), lanes.rend());
+  // rows by the upper edge of the rectangles, as computed in the
+  // layout:
+  double ytop(paperwidth - 0.5 * notewidth);
+  std::map<double, size_t> row;
+  for(size_t k = 0; k < lanes.size(); ++k)
+    row[ytop - lanes[k].first] = k;
+  size_t bins(std::max(1u, out.overviewbins));
+  double binlen(std::max(musicduration * speed, 1e-6) / bins);
+  std::vector<double> grid(lanes.size() * bins, 0.0);
+  for(size_t k = 0; k < layout.size(); ++k) {
+    auto r(row.find(layout.y[k]));
+    if(r == row.end())
+      continue;
+    double x(layout.x[k]);
+    double x2(layout.x2[k]);
+    size_t b1(std::min(bins - 1, (size_t)(x / binlen)));
+    size_t b2(std::min(bins - 1, (size_t)(x2 / binlen)));
+    for(size_t b = b1; b <= b2; ++b)
+      grid[r->second * bins + b] += std::max(
+          0.0, std::min(x2, (b + 1) * binlen) - std::max(x, b * binlen));
+  }
+  std::string name(output_base() + "_overview." + out.overview);
+  std::string file;
+  if(out.overview == "png") {
+    auto surface(
+        Cairo::ImageSurface::create(Cairo::FORMAT_RGB24, bins, lanes.size()));
+    surface->flush();
+    unsigned char* data(surface->get_data());
+    for(size_t r = 0; r < lanes.size(); ++r) {
+      uint32_t* line((uint32_t*)(data + r * surface->get_stride()));
+      for(size_t b = 0; b < bins; ++b) {
+        uint32_t v(255 - 255 * std::min(1.0, grid[r * bins + b] / binlen));
+        line[b] = (v << 16) | (v << 8) | v;
+      }
+    }
+    surface->mark_dirty();
+    surface->write_to_png_stream(
+        [&file](const unsigned char* buf, unsigned int len) {
+          file.append((const char*)buf, len);
+          return CAIRO_STATUS_SUCCESS;
+        });
+  } else {
+    nlohmann::json js;
+    js["length"] = musicduration * speed;
+    js["binlength"] = binlen;
+    for(const auto& lane : lanes)
+      js["lanes"].push_back({{"pitch", lane.second},
+                             {"name", pitch2name(lane.second)},
+                             {"position", lane.first}});
+    for(size_t r = 0; r < lanes.size(); ++r) {
+      std::vector<int> occ(bins);
+      for(size_t b = 0; b < bins; ++b)
+        occ[b] = round(100 * std::min(1.0, grid[r * bins + b] / binlen));
+      js["occupancy"].push_back(occ);
+    }
+    file = js.dump() + "\n";
+  }
+  // like the pages, through the output writer and into the archive:
+  write_file(name, std::move(file));
+}
+
+// number of pages covering the music:
+uint32_t midi2svg_t::pages() const
 {
-  double pagestart(0);
   uint32_t page(0);
-  while(pagestart < musicduration * speed) {
-    char ctmp[1024];
-    sprintf(ctmp, "%s_%03d.svg", filename.c_str(), page);
-    generate_svg(ctmp, pagestart);
-    pagestart += maxpaperlength;
+  for(double pagestart = 0; pagestart < musicduration * speed;
+      pagestart += maxpaperlength)
     ++page;
-  }
+  return page;
 }
 
-void midi2svg_t::read(const std::string& midi_file)
+/**
+   Convert a MIDI file in a single pass with bounded memory. Events are
+   decoded incrementally, and each page is written as soon as all notes
+   which can reach into it are known and the music is known to
+   continue after it. Notes are retired once their last page is
+   written.
+ */
+void midi2svg_t::convert_stream(const std::string& midi_file)
 {
   filename = midi_file;
-  midifile.read(midi_file);
-  midifile.linkNotePairs();  // first link note-ons to note-offs
-  midifile.doTimeAnalysis(); // then create ticks to seconds mapping
-  for(int k = 0; k < midifile.size(); ++k) {
-    smf::MidiEventList& eventlist(midifile[k]);
-    if(hasNotes(eventlist)) {
-      for(int kevent = 0; kevent < eventlist.size(); ++kevent) {
-        auto& event(eventlist[kevent]);
-        if(event.isNoteOn()) {
-          note_t note({event.getP1(), event.getDurationInSeconds(),
-                       event.seconds + presilence});
-          if(pitches.find(note.pitch) != pitches.end())
-            notes.push_back(note);
-          else
-            std::cerr << "Warning: note " << pitch2name(note.pitch) << " at "
-                      << note.time - presilence << " not covered.\n";
-          musicduration = std::max(musicduration, note.time + note.duration);
-        }
+  midi_stream_t stream(midi_file);
+  std::vector<note_pairing_t> open;
+  for(size_t k = 0; k < stream.size(); ++k)
+    open.emplace_back(k, &pool);
+  double maxend(0);
+  double pagestart(0);
+  uint32_t page(0);
+  // placed notes are already in the notes list:
+  auto end_note = [&](const note_t& note, bool placed) {
+    if(!route.matches(note))
+      return;
+    if(!placed)
+      add_note(note);
+    maxend = std::max(maxend, note.time + note.duration);
+  };
+  // only open notes which are cut into this tape hold back a page:
+  auto counts = [&](const note_t& note) {
+    return route.matches(note) && (pitches.find(note.pitch) != pitches.end());
+  };
+  // notes held for longer than this have their longest hole, and are
+  // placed without waiting for their note-off:
+  double longest((maxnotelength + mingaplength) / speed);
+  auto place = [&](const note_t& note) {
+    if(!counts(note))
+      return false;
+    add_note(note);
+    return true;
+  };
+  auto write_page = [&]() {
+    double pageend(pagestart + maxpaperlength);
+    compute_layout();
+    output_page(page, pagestart);
+    notes.remove_if(
+        [&](const note_t& note) { return note_end(note) <= pageend; });
+    pagestart = pageend;
+    ++page;
+  };
+  midi_event_t event;
+  while(stream.next(event)) {
+    if(event.status == 0xff || !stream.has_notes(event.track))
+      continue;
+    uint8_t cmd(event.status & 0xf0);
+    uint8_t channel(event.status & 0x0f);
+    double now(event.seconds + presilence);
+    note_t note;
+    bool placed(false);
+    if((cmd == 0x90) && event.data2)
+      open[event.track].note_on(channel, event.data1, now);
+    else if(((cmd == 0x80) || (cmd == 0x90)) &&
+            open[event.track].note_off(channel, event.data1, now, note,
+                                       &placed))
+      end_note(note, placed);
+    while((now * speed >= pagestart + maxpaperlength) && (maxend > 0) &&
+          ((maxend + postsilence) * speed >= pagestart + maxpaperlength)) {
+      bool blocked(false);
+      for(auto& pairing : open) {
+        pairing.place(now - longest, now, place);
+        if(pairing.earliest_open(counts) * speed < pagestart + maxpaperlength)
+          blocked = true;
       }
+      if(blocked)
+        break;
+      musicduration = maxend + postsilence;
+      write_page();
     }
   }
+  for(auto& pairing : open)
+    pairing.flush(end_note);
+  musicduration = maxend;
   if(musicduration > 0)
     musicduration += postsilence;
+  while(pagestart < musicduration * speed)
+    write_page();
 }
 
-void midi2svg_t::generate_svg(const std::string& svgname, double offset_mm)
+/**
+   Add a completed note, or log a warning if the pitch is not covered
+   by the instrument.
+ */
+void midi2svg_t::add_note(const note_t& note)
 {
-  double scale(72.0 / 25.4001);
-  double w(maxpaperlength * scale);
-  double h((paperwidth + offset) * scale);
-  auto surface(Cairo::SvgSurface::create(svgname, w, h));
-  auto cr(Cairo::Context::create(surface));
-  cr->scale(scale, scale);
-  // cr->translate(0, -offset);
-  cr->set_line_width(0.1);
-  cr->set_font_size(4);
-  cr->set_source_rgb(0, 0, 0);
-  // create notes:
-  cr->save();
-  for(auto note : notes) {
-    if(pitches.find(note.pitch) != pitches.end()) {
-      double y(pitches[note.pitch]);
-      double x(note.time * speed);
-      double len(note.duration * speed);
-      if(len >= mingaplength)
-        len -= mingaplength;
-      len = std::min(len, maxnotelength);
-      len = std::max(len, minnotelength);
-      double x2(x + len);
-      if((x2 > offset_mm) || (x < offset_mm + maxpaperlength)) {
-        x -= offset_mm;
-        x2 -= offset_mm;
-        x = std::max(0.0, std::min(maxpaperlength, x));
-        x2 = std::max(0.0, std::min(maxpaperlength, x2));
-        len = x2 - x;
-        if(len > 0) {
-          cr->rectangle(x, paperwidth - y - 0.5 * notewidth, std::max(0.0, len),
-                        std::max(0.0, notewidth));
-          cr->fill();
-        }
-      }
-    }
+  if(pitches.find(note.pitch) != pitches.end())
+    notes.push_back(note);
+  else {
+    log += "Warning: note ";
+    log += pitch2name(note.pitch);
+    log += " at ";
+    log += to_string(note.time - presilence);
+    log += " not covered.\n";
   }
-  cr->restore();
-  // cut edges:
-  cr->save();
-  if(cuthighedge) {
-    cr->move_to(0, 0);
-    cr->line_to(maxpaperlength, 0);
+}
+
+/**
+   Add the decoded notes of a MIDI file which are routed to this tape,
+   shifted by the presilence.
+ */
+void midi2svg_t::add_notes(const std::string& midi_file,
+                           const std::pmr::vector<note_t>& decoded)
+{
+  filename = midi_file;
+  for(note_t note : decoded) {
+    if(!route.matches(note))
+      continue;
+    note.time += presilence;
+    add_note(note);
+    musicduration = std::max(musicduration, note.time + note.duration);
   }
-  if(cutlowedge) {
-    cr->move_to(0, paperwidth);
-    cr->line_to(maxpaperlength, paperwidth);
+  if(musicduration > 0)
+    musicduration += postsilence;
+}
+
+// Header of a layout cache file, followed by the rectangle arrays and
+// the conversion log:
+struct layout_cache_t {
+  char magic[4];
+  uint32_t version;
+  uint64_t midihash;
+  uint64_t cfghash;
+  uint64_t size;
+  uint64_t loglength;
+  double musicduration;
+};
+
+#define LAYOUT_CACHE_MAGIC "M2SL"
+#define LAYOUT_CACHE_VERSION 1
+#define LAYOUT_CACHE_EXT ".m2sl"
+#define LAYOUT_CACHE_TMP ".tmp"
+
+/**
+   Read a cached layout. Entries which do not match, are truncated or
+   are not layout files at all are a cache miss, and leave the layout
+   empty.
+ */
+bool midi2svg_t::load_layout(const std::string& fname, uint64_t midihash,
+                             uint64_t cfghash)
+{
+  std::ifstream ifs(fname, std::ios::binary | std::ios::ate);
+  if(!ifs)
+    return false;
+  uint64_t filesize(ifs.tellg());
+  ifs.seekg(0);
+  layout_cache_t hdr;
+  if(!ifs.read((char*)&hdr, sizeof(hdr)))
+    return false;
+  // the sizes are checked before allocating anything:
+  uint64_t datasize(filesize - sizeof(hdr));
+  if((memcmp(hdr.magic, LAYOUT_CACHE_MAGIC, 4) != 0) ||
+     (hdr.version != LAYOUT_CACHE_VERSION) || (hdr.midihash != midihash) ||
+     (hdr.cfghash != cfghash) || (hdr.size > datasize / 24) ||
+     (hdr.loglength != datasize - 24 * hdr.size))
+    return false;
+  try {
+    layout.resize(hdr.size);
+    log.resize(hdr.loglength);
   }
-  if(cutend && (musicduration * speed < offset_mm + maxpaperlength)) {
-    cr->move_to(musicduration * speed - offset_mm, 0);
-    cr->line_to(musicduration * speed - offset_mm, paperwidth);
+  catch(const std::exception&) {
+    layout.resize(0);
+    log.clear();
+    return false;
   }
-  cr->stroke();
-  cr->restore();
-  // page name:
-  cr->save();
-  cr->set_source_rgb(1, 0, 0);
-  cr->move_to(2, paperwidth - 2);
-  cr->text_path(svgname);
-  cr->stroke();
-  if(musicduration * speed >= offset_mm + maxpaperlength) {
-    cr->set_source_rgb(0, 0, 0);
-    cr->move_to(maxpaperlength, paperwidth - 3);
-    cr->line_to(maxpaperlength, paperwidth - 6);
-    cr->stroke();
+  for(auto vec : {&layout.x, &layout.x2, &layout.y})
+    ifs.read((char*)vec->data(), hdr.size * sizeof(double));
+  ifs.read(log.data(), hdr.loglength);
+  if(!ifs) {
+    layout.resize(0);
+    log.clear();
+    return false;
   }
-  cr->restore();
-  // crop marks:
-  cr->save();
-  cr->set_source_rgb(1, 0, 0);
-  cr->move_to(0, paperwidth);
-  cr->line_to(2.0, paperwidth);
-  cr->move_to(0, 0);
-  cr->line_to(2.0, 0);
-  if(offset > 0) {
-    cr->move_to(0, paperwidth + offset);
-    cr->line_to(2.0, paperwidth + offset);
+  musicduration = hdr.musicduration;
+  layout.maxlength = 0;
+  for(size_t k = 0; k < layout.size(); ++k)
+    layout.maxlength = std::max(layout.maxlength, layout.x2[k] - layout.x[k]);
+  return true;
+}
+
+void midi2svg_t::save_layout(const std::string& fname, uint64_t midihash,
+                             uint64_t cfghash)
+{
+  layout_cache_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, LAYOUT_CACHE_MAGIC, 4);
+  hdr.version = LAYOUT_CACHE_VERSION;
+  hdr.midihash = midihash;
+  hdr.cfghash = cfghash;
+  hdr.size = layout.size();
+  hdr.loglength = log.size();
+  hdr.musicduration = musicduration;
+  // write to a temporary file first, parallel workers may read the
+  // same entry:
+  std::stringstream tmpname;
+  tmpname << fname << "." << std::this_thread::get_id() << LAYOUT_CACHE_TMP;
+  {
+    std::ofstream ofs(tmpname.str(), std::ios::binary);
+    ofs.write((const char*)&hdr, sizeof(hdr));
+    for(auto vec : {&layout.x, &layout.x2, &layout.y})
+      ofs.write((const char*)vec->data(), hdr.size * sizeof(double));
+    ofs.write(log.data(), hdr.loglength);
+    if(!ofs.good()) {
+      std::error_code ec;
+      std::filesystem::remove(tmpname.str(), ec);
+      return;
+    }
   }
-  cr->stroke();
-  cr->restore();
+  std::error_code ec;
+  std::filesystem::rename(tmpname.str(), fname, ec);
+}
+
+/**
+   Remove the least recently used entries from the layout cache until
+   its size is below the limit. Temporary files left behind by an
+   interrupted process are removed once they are an hour old; younger
+   ones may still be written by another process.
+ */
+void trim_layout_cache(const std::string& dir, uint64_t maxsize)
+{
+  std::error_code ec;
+  std::vector<std::pair<std::filesystem::file_time_type,
+                        std::filesystem::directory_entry>>
+      entries;
+  uint64_t total(0);
+  auto stale(std::filesystem::file_time_type::clock::now() -
+             std::chrono::hours(1));
+  for(const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    if(entry.path().extension() == LAYOUT_CACHE_TMP) {
+      auto mtime(entry.last_write_time(ec));
+      if(!ec && (mtime < stale))
+        std::filesystem::remove(entry.path(), ec);
+      continue;
+    }
+    if(entry.path().extension() != LAYOUT_CACHE_EXT)
+      continue;
+    auto size(entry.file_size(ec));
+    if(ec)
+      continue;
+    total += size;
+    entries.push_back({entry.last_write_time(ec), entry});
+  }
+  std::sort(entries.begin(), entries.end());
+  for(const auto& entry : entries) {
+    if(total <= maxsize)
+      break;
+    total -= entry.second.file_size(ec);
+    std::filesystem::remove(entry.second.path(), ec);
+  }
+}
+
+/**
+   Read a MIDI file through the layout cache: the layout is looked up
+   by a hash of the MIDI data and of the instrument settings, and only
+   computed (and added to the cache) if it is not found.
+ */
+std::string midi2svg_t::cache_name(uint64_t midihash) const
+{
+  char ctmp[64];
+  snprintf(ctmp, sizeof(ctmp), "/%016llx%016llx" LAYOUT_CACHE_EXT,
+           (unsigned long long)midihash, (unsigned long long)layouthash);
+  return out.cachedir + ctmp;
+}
+
+/**
+   Load the layout of a MIDI file with the given hash from the cache.
+   Returns false if it is not cached.
+ */
+bool midi2svg_t::load_cached(const std::string& midi_file, uint64_t midihash)
+{
+  std::string fname(cache_name(midihash));
+  filename = midi_file;
+  if(!load_layout(fname, midihash, layouthash))
+    return false;
+  // mark as recently used:
+  std::error_code ec;
+  std::filesystem::last_write_time(
+      fname, std::filesystem::file_time_type::clock::now(), ec);
+  return true;
+}
+
+// store the computed layout in the cache, which is trimmed after the
+// batch:
+void midi2svg_t::save_cached(uint64_t midihash)
+{
+  std::error_code ec;
+  std::filesystem::create_directories(out.cachedir, ec);
+  save_layout(cache_name(midihash), midihash, layouthash);
+}
+
+/**
+   Write a rendered output file through the asynchronous writer. All
+   tapes of a MIDI file share one archive, their entries are told apart
+   by the tape tags in the names.
+ */
+void midi2svg_t::write_file(const std::string& name, std::string&& data) const
+{
+  bool compress(std::filesystem::path(name).extension() == ".svgz");
+  if(out.archive)
+    out.writer->write_to_archive(
+        std::string(filename) + ".tar",
+        std::filesystem::path(name).filename().string(), std::move(data),
+        compress);
+  else
+    out.writer->write(name, std::move(data), compress);
+}
+
+// complete the output of a file after the last page of all its tapes:
+void midi2svg_t::finish_output()
+{
+  if(out.archive && !out.dryrun)
+    out.writer->close_archive(std::string(filename) + ".tar");
+}
+
+void midi2svg_t::generate_svg(const std::string& svgname, double offset_mm,
+                              const rect_buffer_t& pagerects) const
+{
+  svg_writer_t svg(maxpaperlength, paperwidth + offset, out.instanced);
+  draw_page(svg, svgname, offset_mm, pagerects);
+  write_file(svgname, svg.finish());
+}
+
+/**
+   Write a page as DXF. Unless the page goes into an archive, it is
+   streamed straight into the file.
+ */
+void midi2svg_t::generate_dxf(const std::string& dxfname, double offset_mm,
+                              const rect_buffer_t& pagerects) const
+{
+  if(out.archive) {
+    std::ostringstream os;
+    dxf_writer_t dxf(os, paperwidth + offset, out.colours);
+    draw_page(dxf, dxfname, offset_mm, pagerects);
+    dxf.finish();
+    write_file(dxfname, os.str());
+    return;
+  }
+  std::ofstream ofs(dxfname, std::ios::binary);
+  dxf_writer_t dxf(ofs, paperwidth + offset, out.colours);
+  draw_page(dxf, dxfname, offset_mm, pagerects);
+  dxf.finish();
+  if(!ofs)
+    throw std::runtime_error("unable to write file " + dxfname);
+}
+
+/**
+   Write a page as PDF, for proofing. The operation layers are drawn
+   in their order, but are not separated in the PDF.
+ */
+void midi2svg_t::generate_pdf(const std::string& pdfname, double offset_mm,
+                              const rect_buffer_t& pagerects) const
+{
+  double scale(72.0 / 25.4);
+  std::string data;
+  auto surface(Cairo::PdfSurface::create_for_stream(
+      [&data](const unsigned char* buf, unsigned int len) {
+        data.append((const char*)buf, len);
+        return CAIRO_STATUS_SUCCESS;
+      },
+      maxpaperlength * scale, (paperwidth + offset) * scale));
+  auto cr(Cairo::Context::create(surface));
+  cr->scale(scale, scale);
+  cairo_backend_t page(cr);
+  draw_page(page, pdfname, offset_mm, pagerects);
   cr->show_page();
+  surface->finish();
+  write_file(pdfname, std::move(data));
 }
 
-bool midi2svg_t::hasNotes(const smf::MidiEventList& eventlist)
+/**
+   Render a page preview into a PNG image. The page is split into
+   tiles along the tape, which are rasterized in parallel into the
+   same image buffer.
+ */
+void midi2svg_t::generate_png(const std::string& pngname, double offset_mm,
+                              const rect_buffer_t& pagerects) const
 {
-  for(int i = 0; i < eventlist.size(); i++) {
-    if(eventlist[i].isNoteOn()) {
-      if(eventlist[i].getChannel() != 0x09) {
-        return true;
-      }
+  double scale(out.dpi / 25.4);
+  int w(std::max(1.0, ceil(maxpaperlength * scale)));
+  int h(std::max(1.0, ceil((paperwidth + offset) * scale)));
+  auto surface(Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, w, h));
+  surface->flush();
+  unsigned char* data(surface->get_data());
+  int stride(surface->get_stride());
+  int ntiles(std::max(1, std::min((int)out.rasterthreads, w / 64)));
+  auto render_tile = [&](int tile) {
+    int x0(tile * w / ntiles);
+    int x1((tile + 1) * w / ntiles);
+    auto tilesurface(Cairo::ImageSurface::create(
+        data + 4 * x0, Cairo::FORMAT_ARGB32, x1 - x0, h, stride));
+    auto cr(Cairo::Context::create(tilesurface));
+    cr->set_source_rgb(1, 1, 1);
+    cr->paint();
+    cr->translate(-x0, 0);
+    cr->scale(scale, scale);
+    cairo_backend_t page(cr);
+    draw_page(page, pngname, offset_mm, pagerects);
+    tilesurface->flush();
+  };
+  std::vector<std::thread> threads;
+  for(int tile = 1; tile < ntiles; ++tile)
+    threads.emplace_back(render_tile, tile);
+  render_tile(0);
+  for(auto& th : threads)
+    th.join();
+  surface->mark_dirty();
+  std::string png;
+  surface->write_to_png_stream(
+      [&png](const unsigned char* buf, unsigned int len) {
+        png.append((const char*)buf, len);
+        return CAIRO_STATUS_SUCCESS;
+      });
+  write_file(pngname, std::move(png));
+}
+
+/**
+   Draw the layers of a page: page label, marks, notes and cut lines,
+   in mm.
+ */
+void midi2svg_t::draw_page(page_backend_t& page, const std::string& label,
+                           double offset_mm,
+                           const rect_buffer_t& pagerects) const
+{
+  bool continued(musicduration * speed >= offset_mm + maxpaperlength);
+  for(int layer = 0; layer < LAYER_COUNT; ++layer) {
+    page.begin_layer((layer_t)layer, out.colours[layer]);
+    switch(layer) {
+    case LAYER_ENGRAVE_LABELS:
+      page.stroke_text(2, paperwidth - 2, label);
+      break;
+    case LAYER_MARKS:
+      page.replay({instrumenthash, 0},
+                  [&](page_backend_t& rec) { draw_marks(rec); });
+      break;
+    case LAYER_CUT_HOLES:
+      for(size_t k = 0; k < pagerects.size; ++k)
+        page.rectangle(pagerects.x[k], pagerects.y[k], pagerects.w[k],
+                       std::max(0.0, notewidth));
+      break;
+    case LAYER_CUT_EDGES:
+      page.replay({instrumenthash, 2},
+                  [&](page_backend_t& rec) { draw_edges(rec); });
+      if(continued)
+        page.replay({instrumenthash, 1}, [&](page_backend_t& rec) {
+          rec.line(maxpaperlength, paperwidth - 3, maxpaperlength,
+                   paperwidth - 6);
+        });
+      else if(cutend)
+        page.line(musicduration * speed - offset_mm, 0,
+                  musicduration * speed - offset_mm, paperwidth);
+      break;
+    }
+    page.end_layer();
+  }
+}
+
+// page invariant edge cuts:
+void midi2svg_t::draw_edges(page_backend_t& page) const
+{
+  if(cuthighedge)
+    page.line(0, 0, maxpaperlength, 0);
+  if(cutlowedge)
+    page.line(0, paperwidth, maxpaperlength, paperwidth);
+}
+
+// page invariant crop marks:
+void midi2svg_t::draw_marks(page_backend_t& page) const
+{
+  page.line(0, paperwidth, 2.0, paperwidth);
+  page.line(0, 0, 2.0, 0);
+  if(offset > 0)
+    page.line(0, paperwidth + offset, 2.0, paperwidth + offset);
+}
+
+/**
+   Work-stealing task scheduler. Each worker has its own task queue;
+   tasks spawned by a task go to the back of the queue of its worker,
+   which runs its newest tasks first. Idle workers steal the oldest
+   task of another worker, so a large file gets its pages spread over
+   all workers. Workers without work wait until a task is spawned.
+ */
+class scheduler_t {
+public:
+  scheduler_t(uint32_t workers);
+  void spawn(std::function<void()> task);
+  void spawn(size_t worker, std::function<void()> task);
+  void run();
+
+private:
+  struct queue_t {
+    std::mutex mtx;
+    std::deque<std::function<void()>> tasks;
+  };
+  bool pop(size_t worker, std::function<void()>& task);
+  void work(size_t worker);
+  void wake(bool all);
+  std::vector<queue_t> queues;
+  // spawned tasks which did not finish yet:
+  std::atomic<size_t> pending;
+  // tasks waiting in the queues:
+  std::atomic<size_t> queued;
+  std::mutex idlemtx;
+  std::condition_variable idle;
+  static thread_local size_t self;
+};
+
+thread_local size_t scheduler_t::self(0);
+
+scheduler_t::scheduler_t(uint32_t workers)
+    : queues(std::max(1u, workers)), pending(0), queued(0)
+{
+}
+
+// the lock orders the notification after the check of a waiting worker:
+void scheduler_t::wake(bool all)
+{
+  std::lock_guard<std::mutex> lock(idlemtx);
+  if(all)
+    idle.notify_all();
+  else
+    idle.notify_one();
+}
+
+// spawn a task on the queue of the calling worker:
+void scheduler_t::spawn(std::function<void()> task)
+{
+  spawn(self, std::move(task));
+}
+
+void scheduler_t::spawn(size_t worker, std::function<void()> task)
+{
+  queue_t& queue(queues[worker % queues.size()]);
+  ++pending;
+  {
+    std::lock_guard<std::mutex> lock(queue.mtx);
+    queue.tasks.push_back(std::move(task));
+  }
+  ++queued;
+  wake(false);
+}
+
+// take the newest own task, or else steal the oldest task of another
+// worker:
+bool scheduler_t::pop(size_t worker, std::function<void()>& task)
+{
+  for(size_t k = 0; (k < queues.size()) && (queued > 0); ++k) {
+    queue_t& queue(queues[(worker + k) % queues.size()]);
+    std::lock_guard<std::mutex> lock(queue.mtx);
+    if(queue.tasks.empty())
+      continue;
+    --queued;
+    if(k == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
     }
+    return true;
   }
   return false;
 }
 
+void scheduler_t::work(size_t worker)
+{
+  self = worker;
+  std::function<void()> task;
+  while(pending > 0) {
+    if(pop(worker, task)) {
+      task();
+      task = nullptr;
+      // the last task releases all waiting workers:
+      if(--pending == 0)
+        wake(true);
+    } else {
+      std::unique_lock<std::mutex> lock(idlemtx);
+      idle.wait(lock, [this]() { return (queued > 0) || (pending == 0); });
+    }
+  }
+}
+
+/**
+   Run all spawned tasks, and the tasks spawned by them, with one
+   worker per queue. Tasks must not throw.
+ */
+void scheduler_t::run()
+{
+  std::vector<std::thread> threads;
+  for(size_t k = 1; k < queues.size(); ++k)
+    threads.emplace_back(&scheduler_t::work, this, k);
+  work(0);
+  for(auto& th : threads)
+    th.join();
+}
+
+/**
+   Convert a batch of MIDI files for a number of instruments with a
+   number of worker threads. Each file is decoded once into an
+   instrument independent note list, which is then laid out and
+   rendered for each instrument, or each routing rule of an
+   instrument, as a separate tape. Decoding, the layout of each tape
+   and the rendering of each page are tasks, scheduled by work
+   stealing. The decoded notes of each file and the state of each tape
+   live in monotonic arenas taken from a pool; after the last task of
+   the file job the arenas are released and handed back for the next
+   jobs. Returns the number of files which failed.
+ */
+size_t convert_files(const std::vector<instrument_t>& instruments,
+                     const std::vector<std::string>& files, uint32_t jobs,
+                     output_cfg_t cfg)
+{
+  struct arena_t {
+    arena_t() : buffer(1 << 20), resource(buffer.data(), buffer.size()) {}
+    std::vector<char> buffer;
+    std::pmr::monotonic_buffer_resource resource;
+  };
+  struct tape_job_t {
+    tape_job_t(const instrument_t& instrument, const output_cfg_t& cfg,
+               std::unique_ptr<arena_t> arena_)
+        : arena(std::move(arena_)), m2s(instrument, cfg, &arena->resource),
+          cached(false)
+    {
+    }
+    std::unique_ptr<arena_t> arena;
+    midi2svg_t m2s;
+    bool cached; // layout was loaded from the cache
+  };
+  struct file_job_t {
+    file_job_t(const std::string& fname, std::unique_ptr<arena_t> arena_)
+        : name(fname), arena(std::move(arena_)), notes(&arena->resource),
+          failed(false), tasks(0)
+    {
+    }
+    std::string name;
+    std::unique_ptr<arena_t> arena;
+    std::pmr::vector<note_t> notes; // instrument independent notes
+    std::vector<std::unique_ptr<tape_job_t>> tapes;
+    std::atomic<bool> failed;
+    // tasks of this job which did not finish yet:
+    std::atomic<uint32_t> tasks;
+  };
+  typedef std::function<void(file_job_t*)> job_task_t;
+  // pages are tasks, so even a single file uses all workers:
+  scheduler_t scheduler(jobs);
+  std::atomic<size_t> failed(0);
+  std::mutex logmtx;
+  // arenas of finished jobs and tapes, reused by the next ones:
+  std::vector<std::unique_ptr<arena_t>> arenas;
+  std::mutex arenamtx;
+  auto take_arena = [&]() {
+    std::lock_guard<std::mutex> lock(arenamtx);
+    if(arenas.empty())
+      return std::unique_ptr<arena_t>(new arena_t());
+    std::unique_ptr<arena_t> arena(std::move(arenas.back()));
+    arenas.pop_back();
+    return arena;
+  };
+  auto give_arena = [&](std::unique_ptr<arena_t> arena) {
+    arena->resource.release();
+    std::lock_guard<std::mutex> lock(arenamtx);
+    arenas.push_back(std::move(arena));
+  };
+  output_writer_t writer;
+  cfg.writer = &writer;
+  // pages are scheduled as tasks and rasterized on one thread each;
+  // only streamed tapes, which render their pages within a single
+  // task, rasterize tiles on the cores not used by other tapes:
+  cfg.rasterthreads = 1;
+  if(cfg.stream && cfg.overview.empty() && !cfg.dryrun) {
+    size_t tapes(0);
+    for(const auto& instrument : instruments)
+      tapes += std::max((size_t)1, instrument.routes.size());
+    cfg.rasterthreads =
+        std::max((size_t)1, jobs / std::max((size_t)1, files.size() * tapes));
+  }
+  auto error = [&](const std::string& name, const std::exception& e) {
+    std::lock_guard<std::mutex> lock(logmtx);
+    std::cerr << "Error: " << name << ": " << e.what() << std::endl;
+  };
+  // run a task of a file job, and finish the job after its last task:
+  auto run_task = [&](file_job_t* job, const job_task_t& task) {
+    try {
+      if(!job->failed)
+        task(job);
+    }
+    catch(const std::exception& e) {
+      error(job->name, e);
+      job->failed = true;
+    }
+    if(--job->tasks > 0)
+      return;
+    // the tapes share the archive of the file:
+    if(!job->tapes.empty())
+      job->tapes.front()->m2s.finish_output();
+    if(job->failed)
+      ++failed;
+    {
+      std::lock_guard<std::mutex> lock(logmtx);
+      for(const auto& tape : job->tapes)
+        std::cerr << tape->m2s.get_log();
+    }
+    // release the state of the job and its tapes, and keep the arenas:
+    for(auto& tape : job->tapes) {
+      std::unique_ptr<arena_t> arena(std::move(tape->arena));
+      tape.reset();
+      give_arena(std::move(arena));
+    }
+    std::unique_ptr<arena_t> arena(std::move(job->arena));
+    delete job;
+    give_arena(std::move(arena));
+  };
+  auto spawn_task = [&](file_job_t* job, job_task_t task) {
+    ++job->tasks;
+    scheduler.spawn([&run_task, job, task]() { run_task(job, task); });
+  };
+  auto render = [&](file_job_t* job, midi2svg_t* m2s) {
+    if(cfg.dryrun) {
+      std::string report(m2s->estimate_report());
+      std::lock_guard<std::mutex> lock(logmtx);
+      std::cout << report;
+      return;
+    }
+    if(!cfg.overview.empty()) {
+      m2s->output_overview();
+      return;
+    }
+    for(uint32_t page = 0; page < m2s->pages(); ++page)
+      spawn_task(job, [&, m2s, page](file_job_t* job) {
+        double offset_mm(page * m2s->maxpaperlength);
+        auto pagerects(
+            std::make_shared<rect_buffer_t>(std::pmr::get_default_resource()));
+        m2s->compute_rects(offset_mm, *pagerects);
+        // the formats of a page are rendered concurrently from the
+        // same rectangles:
+        for(const auto& format : cfg.formats)
+          spawn_task(job, [=, &format](file_job_t* job) {
+            m2s->render_format(page, offset_mm, format, *pagerects);
+          });
+      });
+  };
+  auto decode = [&](file_job_t* job) {
+    for(const auto& instrument : instruments) {
+      // several instruments are told apart by their name, and each
+      // routing rule gets its own tape:
+      auto tags(instrument.tape_tags(instruments.size() > 1));
+      for(size_t k = 0; k < tags.size(); ++k) {
+        job->tapes.emplace_back(new tape_job_t(instrument, cfg, take_arena()));
+        if(!instrument.routes.empty())
+          job->tapes.back()->m2s.set_route(instrument.routes[k]);
+        job->tapes.back()->m2s.set_tag(tags[k]);
+      }
+    }
+    if(cfg.stream && cfg.overview.empty() && !cfg.dryrun) {
+      for(auto& tape : job->tapes)
+        spawn_task(job, [m2s = &tape->m2s](file_job_t* job) {
+          m2s->convert_stream(job->name);
+        });
+      return;
+    }
+    // a cached layout replaces both decoding and layout:
+    uint64_t midihash(0);
+    bool allcached(!cfg.cachedir.empty());
+    if(!cfg.cachedir.empty()) {
+      midihash = fnv1a(get_file_contents(job->name));
+      for(auto& tape : job->tapes) {
+        tape->cached = tape->m2s.load_cached(job->name, midihash);
+        allcached = allcached && tape->cached;
+      }
+    }
+    if(!allcached)
+      decode_midi(job->name, job->notes);
+    for(auto& tape : job->tapes)
+      spawn_task(job, [&, midihash, tape = tape.get()](file_job_t* job) {
+        if(!tape->cached) {
+          tape->m2s.add_notes(job->name, job->notes);
+          tape->m2s.compute_layout();
+          // a dry run writes no files, not even cache entries:
+          if(!cfg.cachedir.empty() && !cfg.dryrun)
+            tape->m2s.save_cached(midihash);
+        }
+        render(job, &tape->m2s);
+      });
+  };
+  // file jobs are created by their first task, so arenas are only
+  // needed for the files in progress:
+  for(size_t k = 0; k < files.size(); ++k)
+    scheduler.spawn(k, [&, k]() {
+      file_job_t* job(new file_job_t(files[k], take_arena()));
+      ++job->tasks;
+      run_task(job, decode);
+    });
+  scheduler.run();
+  // a single scan of the cache per batch:
+  if(!cfg.cachedir.empty() && !cfg.dryrun)
+    trim_layout_cache(cfg.cachedir, cfg.cachesize);
+  for(const auto& name : writer.close()) {
+    std::cerr << "Error: unable to write file " << name << std::endl;
+    ++failed;
+  }
+  return failed;
+}
+
+void usage()
+{
+  std::cout
+      << "Usage:\n\nmidi2svg [options] <config file> <midi file> [...]\n"
+         "midi2svg [options] -i <instrument> <midi file> [...]\n"
+         "midi2svg [options] -c <config file> [-c <config file>]\n"
+         "         [-i <instrument>] <midi file> [...]\n"
+         "midi2svg --compile <config file> [<config file> ...]\n\n"
+         "Options:\n"
+         "  -h, --help      show this help\n"
+         "  -c, --config=FILE\n"
+         "                  use an instrument configuration file\n"
+         "  -i, --instrument=NAME\n"
+         "                  use a built-in instrument instead of a config\n"
+         "                  file. JSON configurations can refer to a\n"
+         "                  built-in instrument with the \"instrument\" key\n"
+         "                  and override its settings.\n"
+         "                  -c and -i can be given several times, the MIDI\n"
+         "                  files are then decoded once and converted for\n"
+         "                  each instrument, with the instrument name added\n"
+         "                  to the output names\n"
+         "  -l, --list-instruments\n"
+         "                  list the built-in instruments\n"
+         "  -j, --jobs=N    number of files converted in parallel\n"
+         "  -s, --stream    decode the MIDI file incrementally and write\n"
+         "                  pages as soon as they are complete, with memory\n"
+         "                  use bounded by the page size (for very long\n"
+         "                  files)\n"
+         "  -f, --format=FMT[,FMT...]\n"
+         "                  output formats, \"svg\" (default), \"svgz\"\n"
+         "                  (gzip compressed SVG), \"pdf\", \"dxf\" or\n"
+         "                  \"png\". Several formats are rendered from the\n"
+         "                  same layout in one run\n"
+         "  --colour=LAYER=RRGGBB\n"
+         "                  colour of an output layer, LAYER is one of\n"
+         "                  engrave-labels, marks (default: ff0000),\n"
+         "                  cut-holes or cut-edges (default: 000000)\n"
+         "  --instanced     define each distinct hole shape of an SVG page\n"
+         "                  once, and place the holes as instances of it\n"
+         "  --dedup         merge overlapping holes of the same lane, e.g.\n"
+         "                  from voices doubled in several tracks, so that\n"
+         "                  they are cut only once\n"
+         "  -n, --dry-run   write no files, but print an estimate of the cut\n"
+         "                  job of each tape: pages, holes, cut, engrave\n"
+         "                  and travel lengths, material and machine time\n"
+         "  --cut-speed=MM/S\n"
+         "                  cutting and engraving speed of the estimate\n"
+         "                  (default: 20)\n"
+         "  --travel-speed=MM/S\n"
+         "                  travel speed of the estimate (default: 200)\n"
+         "  --pierce-time=S time to start each path (default: 0.1)\n"
+         "  -a, --archive   write the pages of each MIDI file into a single\n"
+         "                  tar archive <midi file>.tar, with all its\n"
+         "                  tapes\n"
+         "  --dpi=N         resolution of PNG previews (default: 96)\n"
+         "  --overview=FMT  instead of pages, write an overview of the whole\n"
+         "                  tape as lane occupancy grid, \"png\" or \"json\"\n"
+         "  --overview-bins=N\n"
+         "                  number of time bins of the overview (default:\n"
+         "                  512)\n"
+         "  --cache-dir=DIR cache computed layouts in DIR, keyed by the\n"
+         "                  MIDI data and the instrument settings, so\n"
+         "                  repeated conversions skip MIDI parsing and\n"
+         "                  layout (not used with --stream)\n"
+         "  --cache-size=MB size limit of the layout cache (default: 256),\n"
+         "                  least recently used entries are removed\n"
+         "                  after each run\n"
+         "  --compile       compile JSON configurations into binary\n"
+         "                  profiles (<config file>" PROFILE_EXT
+         "), which are\n"
+         "                  used instead of the JSON file while it is\n"
+         "                  unchanged\n";
+}
+
 int main(int argc, char** argv)
 {
-  if(argc < 3) {
-    std::cout << "Usage:\n\nmidi2svg <config file> <midi file>\n";
+  bool compile(false);
+  // instruments as pairs of preset flag and preset or config name:
+  std::vector<std::pair<bool, std::string>> instrumentargs;
+  uint32_t jobs(std::max(1u, std::thread::hardware_concurrency()));
+  output_cfg_t cfg;
+  const char* options = "hc:i:lj:sf:an";
+  struct option long_options[] = {{"help", 0, 0, 'h'},
+                                  {"compile", 0, 0, 'K'},
+                                  {"config", 1, 0, 'c'},
+                                  {"instrument", 1, 0, 'i'},
+                                  {"list-instruments", 0, 0, 'l'},
+                                  {"jobs", 1, 0, 'j'},
+                                  {"stream", 0, 0, 's'},
+                                  {"format", 1, 0, 'f'},
+                                  {"archive", 0, 0, 'a'},
+                                  {"colour", 1, 0, 'L'},
+                                  {"instanced", 0, 0, 'I'},
+                                  {"dedup", 0, 0, 'D'},
+                                  {"dry-run", 0, 0, 'n'},
+                                  {"cut-speed", 1, 0, 'U'},
+                                  {"travel-speed", 1, 0, 'T'},
+                                  {"pierce-time", 1, 0, 'P'},
+                                  {"dpi", 1, 0, 'd'},
+                                  {"overview", 1, 0, 'o'},
+                                  {"overview-bins", 1, 0, 'b'},
+                                  {"cache-dir", 1, 0, 'C'},
+                                  {"cache-size", 1, 0, 'S'},
+                                  {0, 0, 0, 0}};
+  int opt(0);
+  int option_index(0);
+  while((opt = getopt_long(argc, argv, options, long_options,
+                           &option_index)) != -1) {
+    switch(opt) {
+    case 'h':
+      usage();
+      return 0;
+    case 'K':
+      compile = true;
+      break;
+    case 'c':
+      instrumentargs.push_back({false, optarg});
+      break;
+    case 'i':
+      instrumentargs.push_back({true, optarg});
+      break;
+    case 'j':
+      jobs = std::max(1, atoi(optarg));
+      break;
+    case 's':
+      cfg.stream = true;
+      break;
+    case 'f': {
+      // comma separated list of formats:
+      cfg.formats.clear();
+      std::istringstream formats(optarg);
+      std::string format;
+      while(std::getline(formats, format, ',')) {
+        if((format != "svg") && (format != "svgz") && (format != "png") &&
+           (format != "pdf") && (format != "dxf")) {
+          std::cerr << "Error: unsupported format " << format << std::endl;
+          return 1;
+        }
+        if(std::find(cfg.formats.begin(), cfg.formats.end(), format) ==
+           cfg.formats.end())
+          cfg.formats.push_back(format);
+      }
+      if(cfg.formats.empty()) {
+        std::cerr << "Error: no output format" << std::endl;
+        return 1;
+      }
+      break;
+    }
+    case 'a':
+      cfg.archive = true;
+      break;
+    case 'I':
+      cfg.instanced = true;
+      break;
+    case 'D':
+      cfg.dedup = true;
+      break;
+    case 'n':
+      cfg.dryrun = true;
+      break;
+    case 'U':
+    case 'T': {
+      double v(atof(optarg));
+      if(!(v > 0)) {
+        std::cerr << "Error: invalid speed " << optarg << std::endl;
+        return 1;
+      }
+      (opt == 'U' ? cfg.machine.cutspeed : cfg.machine.travelspeed) = v;
+      break;
+    }
+    case 'P':
+      cfg.machine.piercetime = std::max(0.0, atof(optarg));
+      break;
+    case 'L': {
+      std::string arg(optarg);
+      size_t sep(arg.find('='));
+      int layer(0);
+      while((layer < LAYER_COUNT) && (arg.substr(0, sep) != layer_names[layer]))
+        ++layer;
+      std::string colour(sep == std::string::npos ? "" : arg.substr(sep + 1));
+      if(!colour.empty() && (colour[0] == '#'))
+        colour.erase(0, 1);
+      if((layer == LAYER_COUNT) || (colour.size() != 6) ||
+         (colour.find_first_not_of("0123456789abcdefABCDEF") !=
+          std::string::npos)) {
+        std::cerr << "Error: invalid layer colour " << arg << std::endl;
+        return 1;
+      }
+      cfg.colours[layer] = std::stoul(colour, nullptr, 16);
+      break;
+    }
+    case 'd':
+      cfg.dpi = atof(optarg);
+      break;
+    case 'o':
+      cfg.overview = optarg;
+      if((cfg.overview != "png") && (cfg.overview != "json")) {
+        std::cerr << "Error: unsupported overview format " << cfg.overview
+                  << std::endl;
+        return 1;
+      }
+      break;
+    case 'b':
+      cfg.overviewbins = std::max(1, atoi(optarg));
+      break;
+    case 'C':
+      cfg.cachedir = optarg;
+      break;
+    case 'S':
+      cfg.cachesize = std::max(0.0, atof(optarg)) * (1 << 20);
+      break;
+    case 'l':
+      for(const auto& p : presets)
+        std::cout << p.name << "\t" << p.description << std::endl;
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if(compile) {
+    if(optind >= argc) {
+      usage();
+      return 1;
+    }
+    for(int k = optind; k < argc; ++k) {
+      try {
+        instrument_t instrument;
+        instrument.compile(argv[k]);
+      }
+      catch(const std::exception& e) {
+        std::cerr << "Error: " << argv[k] << ": " << e.what() << std::endl;
+        return 1;
+      }
+      std::cout << "compiled " << argv[k] << " to " << argv[k] << PROFILE_EXT
+                << std::endl;
+    }
+    return 0;
+  }
+  // without -c or -i the first argument is the config file:
+  if(instrumentargs.empty() && (optind < argc))
+    instrumentargs.push_back({false, argv[optind++]});
+  if(instrumentargs.empty() || (argc - optind < 1)) {
+    usage();
     return 1;
   }
-  midi2svg_t m2s(argv[1]);
-  m2s.read(argv[2]);
-  m2s.output_svg();
-  // m2s.generate_svg("page0.svg", 0);
+  std::vector<instrument_t> instruments;
+  for(const auto& arg : instrumentargs) {
+    instrument_t instrument;
+    try {
+      if(arg.first) {
+        instrument.load_preset(arg.second);
+        instrument.name = arg.second;
+      } else {
+        instrument.load(arg.second);
+        instrument.name = std::filesystem::path(arg.second).stem().string();
+      }
+    }
+    catch(const std::exception& e) {
+      std::cerr << "Error: " << arg.second << ": " << e.what() << std::endl;
+      return 1;
+    }
+    // instruments of the same name, e.g. the same preset twice or
+    // configurations from different directories, are numbered:
+    std::string name(instrument.name);
+    for(int k = 2; std::any_of(instruments.begin(), instruments.end(),
+                               [&](const instrument_t& other) {
+                                 return other.name == instrument.name;
+                               });
+        ++k)
+      instrument.name = name + "_" + std::to_string(k);
+    // a dry run prints only the estimates:
+    if(!cfg.dryrun) {
+      if(instrumentargs.size() > 1)
+        std::cout << instrument.name << ":\n";
+      instrument.list_pitches();
+    }
+    instruments.push_back(instrument);
+  }
+  // tapes with the same output names would overwrite each other:
+  std::set<std::string> tags;
+  for(const auto& instrument : instruments)
+    for(const auto& tag : instrument.tape_tags(instruments.size() > 1))
+      if(!tags.insert(tag).second) {
+        std::cerr << "Error: several tapes are named \"" << tag << "\""
+                  << std::endl;
+        return 1;
+      }
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if(convert_files(instruments, files, jobs, cfg))
+    return 1;
   return 0;
 }
 